@@ -0,0 +1,78 @@
+#!/usr/bin/env perl
+#
+# Generates src/utf8_properties.inc: general category, White_Space and Alphabetic
+# of every code point, packed into a two-stage lookup table.
+#
+# Usage: perl scripts/gen_properties.pl > src/utf8_properties.inc
+#
+
+use strict;
+use warnings;
+use Unicode::UCD qw(prop_invmap);
+
+my $BLOCK_SHIFT = 7;
+my $BLOCK_SIZE = 1 << $BLOCK_SHIFT;
+
+# Must match utf8::general_category
+my @CATEGORIES = qw(Cn Lu Ll Lt Lm Lo Mn Mc Me Nd Nl No Pc Pd Ps Pe Pi Pf Po Sm Sc Sk So Zs Zl Zp Cc Cf Cs Co);
+my %CATEGORY_INDEX;
+@CATEGORY_INDEX{@CATEGORIES} = 0 .. $#CATEGORIES;
+
+my $WHITE_SPACE_BIT = 0x20;
+my $ALPHABETIC_BIT = 0x40;
+
+# Expands an inversion map into a value per code point
+sub expand {
+    my ($property, $convert) = @_;
+    my ($list, $map) = prop_invmap($property);
+    my @values;
+    for my $i (0 .. $#$list) {
+        my $end = $i < $#$list ? $list->[$i + 1] : 0x110000;
+        my $value = $convert->($map->[$i]);
+        $values[$_] = $value for $list->[$i] .. $end - 1;
+    }
+    return @values;
+}
+
+my @category = expand('General_Category', sub { $CATEGORY_INDEX{$_[0]} // die "unknown category $_[0]" });
+my @white_space = expand('White_Space', sub { $_[0] eq 'Y' ? $WHITE_SPACE_BIT : 0 });
+my @alphabetic = expand('Alphabetic', sub { $_[0] eq 'Y' ? $ALPHABETIC_BIT : 0 });
+
+my (@stage1, @blocks, %block_index);
+for (my $start = 0; $start < 0x110000; $start += $BLOCK_SIZE) {
+    my @block = map { $category[$_] | $white_space[$_] | $alphabetic[$_] } $start .. $start + $BLOCK_SIZE - 1;
+    my $key = join(',', @block);
+    unless (exists $block_index{$key}) {
+        $block_index{$key} = scalar @blocks;
+        push @blocks, \@block;
+    }
+    push @stage1, $block_index{$key};
+}
+
+my $stage1_type = @blocks <= 256 ? 'uint8_t' : 'uint16_t';
+
+print "// Generated by scripts/gen_properties.pl from Unicode ", Unicode::UCD::UnicodeVersion(), " data, do not edit.\n";
+print "//\n";
+print "// PROPERTY_BLOCKS[PROPERTY_STAGE1[code >> $BLOCK_SHIFT]][code & ", $BLOCK_SIZE - 1, "] holds the general\n";
+print "// category in bits 0..4, White_Space in bit 5 and Alphabetic in bit 6.\n\n";
+print "static const int PROPERTY_BLOCK_SHIFT = $BLOCK_SHIFT;\n";
+print "static const unsigned char PROPERTY_WHITE_SPACE = 0x", sprintf('%02X', $WHITE_SPACE_BIT), ";\n";
+print "static const unsigned char PROPERTY_ALPHABETIC = 0x", sprintf('%02X', $ALPHABETIC_BIT), ";\n";
+print "static const unsigned char PROPERTY_CATEGORY = 0x1F;\n\n";
+
+print "static const $stage1_type PROPERTY_STAGE1[", scalar @stage1, "] = {\n";
+for (my $i = 0; $i < @stage1; $i += 16) {
+    my $last = $i + 15 < $#stage1 ? $i + 15 : $#stage1;
+    print "    ", join(', ', @stage1[$i .. $last]), ",\n";
+}
+print "};\n\n";
+
+print "static const unsigned char PROPERTY_BLOCKS[", scalar @blocks, "][$BLOCK_SIZE] = {\n";
+for my $block (@blocks) {
+    print "    {\n";
+    for (my $i = 0; $i < $BLOCK_SIZE; $i += 16) {
+        print "        ", join(', ', map { sprintf('0x%02X', $_) } @$block[$i .. $i + 15]), ",\n";
+    }
+    print "    },\n";
+}
+print "};\n";
@@ -1,4 +1,8 @@
 #include "utf8.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
 
 //
 // Validation based on conditions from:
@@ -22,10 +26,129 @@
 // As a consequence of the well-formedness conditions specified in Table 3-7, the following
 // byte values are disallowed in UTF-8: C0–C1, F5–FF.
 
+// Reads a sequence starting at `bytes` (at most `avail` bytes are available) and checks it
+// against Table 3-7. Returns true if the sequence is well-formed. `num_bytes` receives the
+// length of the sequence, or the number of bytes to skip if it is ill-formed.
+static inline bool check_sequence(const unsigned char* bytes, size_t avail, int& num_bytes)
+{
+    unsigned char first_byte = bytes[0];
+    int num;
+
+    // 1 byte per symbol
+    if ((first_byte & 0x80) == 0x00)
+    {
+        num_bytes = 1;
+        return true;
+    }
+
+    // a missing byte never matches 80..BF
+    unsigned char second_byte = avail > 1 ? bytes[1] : 0;
+    bool valid = true;
+
+    // 2 bytes per symbol
+    if ((first_byte & 0xE0) == 0xC0)
+    {
+        num = 2;
+        valid = first_byte >= 0xC2; // check range (1)
+    }
+    // 3 bytes per symbol
+    else if ((first_byte & 0xF0) == 0xE0)
+    {
+        num = 3;
+        if (first_byte == 0xE0)
+        {
+            valid = second_byte >= 0xA0; // check range (2)
+        }
+        else if (first_byte == 0xED)
+        {
+            valid = second_byte <= 0x9F; // check range (3)
+        }
+    }
+    // 4 bytes per symbol
+    else if ((first_byte & 0xF8) == 0xF0)
+    {
+        num = 4;
+        if (first_byte > 0xF4) // check range (4)
+        {
+            valid = false;
+        }
+        else if (first_byte == 0xF0)
+        {
+            valid = second_byte >= 0x90; // check range (5)
+        }
+        else if (first_byte == 0xF4)
+        {
+            valid = second_byte <= 0x8F; // check range (6)
+        }
+    }
+    else
+    {
+        num_bytes = 1;
+        return false;
+    }
+
+    // check 80..BF (10XXXXXX) trailing bytes
+    for (int i = 1; valid && i < num; ++i)
+    {
+        valid = (size_t)i < avail && (bytes[i] & 0xC0) == 0x80;
+    }
+
+    num_bytes = (size_t)num < avail ? num : (int)avail;
+    return valid;
+}
+
+// Like check_sequence(), but an ill-formed sequence is cut at its maximal subpart (see
+// "U+FFFD Substitution of Maximal Subparts" in chapter 3.9): `num_bytes` receives the length
+// of the longest prefix of a well-formed sequence, at least 1. So a byte that may start
+// a character is never skipped along with a broken one.
+static inline bool next_sequence(const unsigned char* bytes, size_t avail, int& num_bytes)
+{
+    unsigned char first_byte = bytes[0];
+    unsigned char low = 0x80, high = 0xBF; // range of the second byte
+    int num;
+
+    if (first_byte < 0x80)
+    {
+        num_bytes = 1;
+        return true;
+    }
+    if (first_byte >= 0xC2 && first_byte <= 0xDF) // range (1)
+    {
+        num = 2;
+    }
+    else if (first_byte >= 0xE0 && first_byte <= 0xEF)
+    {
+        num = 3;
+        if (first_byte == 0xE0) low = 0xA0;         // range (2)
+        else if (first_byte == 0xED) high = 0x9F;   // range (3)
+    }
+    else if (first_byte >= 0xF0 && first_byte <= 0xF4) // range (4)
+    {
+        num = 4;
+        if (first_byte == 0xF0) low = 0x90;         // range (5)
+        else if (first_byte == 0xF4) high = 0x8F;   // range (6)
+    }
+    else
+    {
+        num_bytes = 1;
+        return false;
+    }
+
+    int i = 1;
+    while (i < num && (size_t)i < avail && bytes[i] >= low && bytes[i] <= high)
+    {
+        low = 0x80;
+        high = 0xBF;
+        i++;
+    }
+
+    num_bytes = i;
+    return i == num;
+}
+
 const char* find_invalid_byte(const char* str, int& num_bytes)
 {
     const unsigned char * bytes = (const unsigned char *)str;
-    int num;
 
     while (*bytes)
     {
@@ -34,89 +157,142 @@ const char* find_invalid_byte(const char* str, int& num_bytes)
         {
             bytes++;
         }
+        // the terminating zero stops the check of trailing bytes
+        else if (check_sequence(bytes, SIZE_MAX, num_bytes))
+        {
+            bytes += num_bytes;
+        }
         else
         {
-            unsigned char first_byte = *bytes;
-            // 2 bytes per symbol
-            if ((first_byte & 0xE0) == 0xC0)
-            {
-                if (first_byte < 0xC2) // check range (1)
-                {
-                    num_bytes = 2;
-                    return (const char*)bytes;
-                }
-                num = 2;
-            }
-            // 3 bytes per symbol
-            else if ((first_byte & 0xF0) == 0xE0) 
-            {
-                if (first_byte == 0xE0)
-                {
-                    if (bytes[1] < 0xA0) // check range (2)
-                    {
-                        num_bytes = 3;
-                        return (const char*)bytes;
-                    }
-                }
-                else if (first_byte == 0xED)
-                {
-                    if (bytes[1] > 0x9F) // check range (3)
-                    {
-                        num_bytes = 3;
-                        return (const char*)bytes;
-                    }
-                }
-                num = 3;
-            }
-            else if ((first_byte & 0xF8) == 0xF0)
-            {
-                if (first_byte > 0xF4)  // check range (4)
-                {
-                    num_bytes = 4;
-                    return (const char*)bytes;
-                }
+            return (const char*)bytes;
+        }
+    }
 
-                if (first_byte == 0xF0)
-                {
-                    if (bytes[1] < 0x90) // check range (5)
-                    {
-                        num_bytes = 4;
-                        return (const char*)bytes;
-                    }
-                }
-                else if (first_byte == 0xF4)
-                {
-                    if (bytes[1] > 0x8F) // check range (6)
-                    {
-                        num_bytes = 4;
-                        return (const char*)bytes;
-                    }
-                }
-                num = 4;
-            }
-            else
-            {
-                num_bytes = 1;
-                return (const char*)bytes;
-            }
+    return nullptr;
+}
 
-            // check 80..BF (10XXXXXX) trailing bytes
-            for (int i = 1; i < num; ++i)
-            {
-                if ((bytes[i] & 0xC0) != 0x80)
-                {
-                    num_bytes = num;
-                    return (const char*)bytes;
-                }
-            }
+// Returns the code point of a well-formed sequence of `num` bytes
+static inline char32_t decode_sequence(const unsigned char* bytes, int num)
+{
+    switch (num)
+    {
+        case 1: return bytes[0];
+        case 2: return ((bytes[0] & 0x1F) << 6) | (bytes[1] & 0x3F);
+        case 3: return ((bytes[0] & 0x0F) << 12) | ((bytes[1] & 0x3F) << 6) | (bytes[2] & 0x3F);
+        default: return ((bytes[0] & 0x07) << 18) | ((bytes[1] & 0x3F) << 12) | ((bytes[2] & 0x3F) << 6) | (bytes[3] & 0x3F);
+    }
+}
 
-            bytes += num;
-        }
+// Writes the UTF-8 sequence of a code point, returns its length
+static inline int encode_char(char32_t code, char* seq)
+{
+    if (code < 0x80)
+    {
+        seq[0] = (char)code;
+        return 1;
+    }
+    if (code < 0x800)
+    {
+        seq[0] = (char)(0xC0 | (code >> 6));
+        seq[1] = (char)(0x80 | (code & 0x3F));
+        return 2;
+    }
+    if (code < 0x10000)
+    {
+        seq[0] = (char)(0xE0 | (code >> 12));
+        seq[1] = (char)(0x80 | ((code >> 6) & 0x3F));
+        seq[2] = (char)(0x80 | (code & 0x3F));
+        return 3;
     }
+    seq[0] = (char)(0xF0 | (code >> 18));
+    seq[1] = (char)(0x80 | ((code >> 12) & 0x3F));
+    seq[2] = (char)(0x80 | ((code >> 6) & 0x3F));
+    seq[3] = (char)(0x80 | (code & 0x3F));
+    return 4;
+}
 
-    return nullptr;
+//
+// Word-at-a-time helpers: 8 bytes are tested with a few integer operations, so clean runs
+// of text are skipped without looking at every byte.
+//
+
+static const uint64_t ONES = 0x0101010101010101ull;
+static const uint64_t HIGHS = 0x8080808080808080ull;
+
+static inline uint64_t load_word(const unsigned char* bytes)
+{
+    uint64_t word;
+    memcpy(&word, bytes, sizeof(word));
+    return word;
+}
+
+// Non-zero if any byte of the word is less than `n` (n <= 0x80)
+static inline uint64_t has_less(uint64_t word, unsigned char n)
+{
+    return (word - ONES * n) & ~word & HIGHS;
+}
+
+// Non-zero if any byte of the word equals `c`
+static inline uint64_t has_byte(uint64_t word, unsigned char c)
+{
+    return has_less(word ^ (ONES * c), 1);
 }
 
+// Non-zero if any ASCII byte of the word is within [lo, hi] (lo <= hi <= 0x7F)
+static inline uint64_t has_between(uint64_t word, unsigned char lo, unsigned char hi)
+{
+    // 7-bit bytes plus at most 0x80 never carry into the next byte
+    uint64_t low7 = word & ~HIGHS;
+    return (low7 + ONES * (0x80 - lo)) & ~(low7 + ONES * (0x7F - hi)) & ~word & HIGHS;
+}
+
+//
+// Output targets shared by the functions writing either into a caller buffer or into a string.
+//
+
+struct buffer_writer
+{
+    char* pos;
+
+    void append(const void* data, size_t size)
+    {
+        memcpy(pos, data, size);
+        pos += size;
+    }
+
+    void append(const std::string& str)
+    {
+        append(str.data(), str.size());
+    }
+
+    void put(char c)
+    {
+        *pos++ = c;
+    }
+};
+
+struct string_writer
+{
+    std::string& str;
+
+    void append(const void* data, size_t size)
+    {
+        str.append((const char*)data, size);
+    }
+
+    void append(const std::string& s)
+    {
+        str.append(s);
+    }
+
+    void put(char c)
+    {
+        str += c;
+    }
+};
+
+static const char HEX_DIGITS[] = "0123456789ABCDEF";
+
 /**
  *  Check if string is UTF-8
  */
@@ -181,6 +357,144 @@ std::string utf8::fix_utf8(const std::string& src, const std::string& replacemen
     return res;
 }
 
+//
+// Sanitizing of well-formed but unwanted code points
+//
+
+// Classes of code points starting with the lead byte, a superset of char_classes() results
+static inline unsigned lead_classes(unsigned char lead)
+{
+    if (lead < 0x20)
+    {
+        return lead == '\t' || lead == '\n' || lead == '\r' ? 0u : utf8::sanitize_c0_controls;
+    }
+    switch (lead)
+    {
+        case 0x7F: return utf8::sanitize_c0_controls;
+        // U+0080..U+009F
+        case 0xC2: return utf8::sanitize_c1_controls;
+        // U+061C
+        case 0xD8: return utf8::sanitize_bidi;
+        // U+200B..U+2069
+        case 0xE2: return utf8::sanitize_bidi | utf8::sanitize_zero_width;
+        // U+FDD0..U+FDEF, U+FEFF, U+FFFE, U+FFFF
+        case 0xEF: return utf8::sanitize_bom | utf8::sanitize_noncharacters;
+        // U+1FFFE..U+10FFFF
+        case 0xF0: case 0xF1: case 0xF2: case 0xF3: case 0xF4:
+            return utf8::sanitize_noncharacters;
+    }
+    return 0;
+}
+
+static inline unsigned char_classes(char32_t code)
+{
+    if (code < 0x20)
+    {
+        return code == '\t' || code == '\n' || code == '\r' ? 0u : utf8::sanitize_c0_controls;
+    }
+    if (code == 0x7F) return utf8::sanitize_c0_controls;
+    if (code >= 0x80 && code <= 0x9F) return utf8::sanitize_c1_controls;
+    if (code == 0x061C || code == 0x200E || code == 0x200F ||
+        (code >= 0x202A && code <= 0x202E) || (code >= 0x2066 && code <= 0x2069))
+    {
+        return utf8::sanitize_bidi;
+    }
+    if ((code >= 0x200B && code <= 0x200D) || code == 0x2060) return utf8::sanitize_zero_width;
+    if (code == 0xFEFF) return utf8::sanitize_bom;
+    if ((code >= 0xFDD0 && code <= 0xFDEF) || (code & 0xFFFE) == 0xFFFE) return utf8::sanitize_noncharacters;
+    return 0;
+}
+
+template <class Writer>
+static void sanitize_to(const unsigned char* src, size_t len, const std::string& replacement,
+                        const utf8::sanitize_policy& policy, Writer& out)
+{
+    const unsigned active = policy.drop | policy.replace | policy.escape;
+    const bool ascii_controls = (active & utf8::sanitize_c0_controls) != 0;
+    const unsigned char* end = src + len;
+    const unsigned char* bytes = src;
+    const unsigned char* run = src; // clean bytes not written yet
+    int num_bytes;
+
+    while (bytes < end)
+    {
+        // ASCII without flagged controls needs neither validation nor sanitizing
+        while (end - bytes >= 8)
+        {
+            uint64_t word = load_word(bytes);
+            if ((word & HIGHS) || (ascii_controls && (has_less(word, 0x20) | has_byte(word, 0x7F))))
+            {
+                break;
+            }
+            bytes += 8;
+        }
+        if (bytes == end)
+        {
+            break;
+        }
+
+        if (!check_sequence(bytes, end - bytes, num_bytes))
+        {
+            out.append(run, bytes - run);
+            out.append(replacement);
+            bytes += num_bytes;
+            run = bytes;
+            continue;
+        }
+
+        unsigned classes = lead_classes(*bytes) & active;
+        if (classes)
+        {
+            char32_t code = decode_sequence(bytes, num_bytes);
+            classes = char_classes(code) & active;
+            if (classes)
+            {
+                out.append(run, bytes - run);
+                if (classes & policy.drop)
+                {
+                    // nothing to write
+                }
+                else if (classes & policy.replace)
+                {
+                    out.append(replacement);
+                }
+                else
+                {
+                    int digits = code < 0x10000 ? 4 : 8;
+                    out.append(digits == 4 ? "\\u" : "\\U", 2);
+                    for (int shift = (digits - 1) * 4; shift >= 0; shift -= 4)
+                    {
+                        out.put(HEX_DIGITS[(code >> shift) & 0x0F]);
+                    }
+                }
+                run = bytes + num_bytes;
+            }
+        }
+        bytes += num_bytes;
+    }
+
+    out.append(run, bytes - run);
+}
+
+/**
+ * Fix UTF-8 characters and sanitize the text in one pass
+ */
+size_t utf8::fix_utf8(const char* src, size_t len, char* dst, const std::string& replacement, const sanitize_policy& policy)
+{
+    buffer_writer out{dst};
+    sanitize_to((const unsigned char*)src, len, replacement, policy, out);
+    return out.pos - dst;
+}
+
+std::string utf8::fix_utf8(const std::string& src, const std::string& replacement, const sanitize_policy& policy)
+{
+    std::string res;
+    res.reserve(src.length());
+    string_writer out{res};
+    sanitize_to((const unsigned char*)src.data(), src.length(), replacement, policy, out);
+    return res;
+}
+
 size_t utf8::length(const char* str)
 {
     if (str == nullptr) return 0;
@@ -239,44 +553,25 @@ static char asciitoupper(char c)
 
 static char* tolower2(unsigned char *res, unsigned char c1, unsigned char c2)
 {
-    switch (c1) {
-        case 0xD0:
-            if (c2 >= 0x90) {
-                if (c2 <= 0x9F) { // [A..П]
-                    c2 = 0xB0 + (c2 - 0x90);
-                } else if (c2 <= 0xAF) { // [Р..Я]
-                    c1 = 0xD1;
-                    c2 = 0x80 + (c2 - 0xA0);
-                }
-            } else if (c2 == 0x81) {
-                c1 = 0xD1; c2 = 0x91; // ё
-            }
-        break;
-    }
     res[0] = c1;
     res[1] = c2;
+    // U+0080..U+07FF are mapped within the same range
+    if (c1 >= 0xC2 && (c2 & 0xC0) == 0x80)
+    {
+        encode_char(utf8::to_lower(decode_sequence(res, 2)), (char*)res);
+    }
     return (char*)res;
 }
 
 static char* toupper2(unsigned char *res, unsigned char c1, unsigned char c2)
 {
-    switch (c1) {
-        case 0xD0:
-            if (c2 >= 0xB0 && c2 <= 0xBF) { // [a..п]
-                c2 = 0x90 + (c2 - 0xB0);
-            }
-        break;
-        case 0xD1:
-            if (c2 >= 0x80 && c2 <= 0x8F) { // [р..я]
-                c1 = 0xD0;
-                c2 = 0xA0 + (c2 - 0x80);
-            } else if (c2 == 0x91) {
-                c1 = 0xD0; c2 = 0x81; // Ё
-            }
-        break;
-    }
     res[0] = c1;
     res[1] = c2;
+    // U+0080..U+07FF are mapped within the same range
+    if (c1 >= 0xC2 && (c2 & 0xC0) == 0x80)
+    {
+        encode_char(utf8::to_upper(decode_sequence(res, 2)), (char*)res);
+    }
     return (char*)res;
 }
 
@@ -382,4 +677,1850 @@ std::string utf8::to_upper(const std::string &str)
     }
 
     return result;
-}
\ No newline at end of file
+}
+
+//
+// JSON strings, RFC 8259 section 7.
+//
+
+// True if the word holds printable ASCII only, without '"' and '\'
+static inline bool is_json_clean_word(uint64_t word)
+{
+    return !((word & HIGHS) | has_less(word, 0x20) | has_byte(word, '"') | has_byte(word, '\\'));
+}
+
+// Writes the escape sequence of an ASCII character that may not appear in a JSON string as is
+template <class Writer>
+static void json_escape_char(unsigned char c, Writer& out)
+{
+    out.put('\\');
+    switch (c)
+    {
+        case '"':  out.put('"'); break;
+        case '\\': out.put('\\'); break;
+        case '\b': out.put('b'); break;
+        case '\f': out.put('f'); break;
+        case '\n': out.put('n'); break;
+        case '\r': out.put('r'); break;
+        case '\t': out.put('t'); break;
+        default:
+            out.append("u00", 3);
+            out.put(HEX_DIGITS[c >> 4]);
+            out.put(HEX_DIGITS[c & 0x0F]);
+    }
+}
+
+static inline bool is_json_special(unsigned char c)
+{
+    return c < 0x20 || c == '"' || c == '\\';
+}
+
+template <class Writer>
+static void json_escape_to(const unsigned char* src, size_t len, const std::string& replacement, Writer& out)
+{
+    const unsigned char* end = src + len;
+    const unsigned char* bytes = src;
+    const unsigned char* run = src; // clean bytes not written yet
+    int num_bytes;
+
+    while (bytes < end)
+    {
+        while (end - bytes >= 8 && is_json_clean_word(load_word(bytes)))
+        {
+            bytes += 8;
+        }
+        if (bytes == end)
+        {
+            break;
+        }
+
+        unsigned char c = *bytes;
+        if (c >= 0x80)
+        {
+            if (next_sequence(bytes, end - bytes, num_bytes))
+            {
+                bytes += num_bytes;
+                continue;
+            }
+            out.append(run, bytes - run);
+            // the replacement must not break the JSON string either
+            for (unsigned char r : replacement)
+            {
+                if (is_json_special(r)) json_escape_char(r, out);
+                else out.put((char)r);
+            }
+            bytes += num_bytes;
+            run = bytes;
+            continue;
+        }
+        if (!is_json_special(c))
+        {
+            bytes++;
+            continue;
+        }
+
+        out.append(run, bytes - run);
+        json_escape_char(c, out);
+        bytes++;
+        run = bytes;
+    }
+
+    out.append(run, bytes - run);
+}
+
+static inline int hex_value(unsigned char c)
+{
+    if (c >= '0' && c <= '9') return c - '0';
+    c |= 0x20;
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    return -1;
+}
+
+// Reads 4 hex digits of a \uXXXX escape, returns -1 if they are malformed
+static inline long read_hex4(const unsigned char* bytes)
+{
+    long value = 0;
+    for (int i = 0; i < 4; ++i)
+    {
+        int digit = hex_value(bytes[i]);
+        if (digit < 0) return -1;
+        value = (value << 4) | digit;
+    }
+    return value;
+}
+
+template <class Writer>
+static bool json_unescape_to(const unsigned char* src, size_t len, Writer& out)
+{
+    const unsigned char* end = src + len;
+    const unsigned char* bytes = src;
+    const unsigned char* run = src; // clean bytes not written yet
+    int num_bytes;
+
+    while (bytes < end)
+    {
+        while (end - bytes >= 8 && is_json_clean_word(load_word(bytes)))
+        {
+            bytes += 8;
+        }
+        if (bytes == end)
+        {
+            break;
+        }
+
+        unsigned char c = *bytes;
+        if (c >= 0x80)
+        {
+            if (!check_sequence(bytes, end - bytes, num_bytes))
+            {
+                return false;
+            }
+            bytes += num_bytes;
+            continue;
+        }
+        if (c >= 0x20 && c != '"' && c != '\\')
+        {
+            bytes++;
+            continue;
+        }
+        if (c != '\\' || end - bytes < 2)
+        {
+            return false;
+        }
+
+        out.append(run, bytes - run);
+        switch (bytes[1])
+        {
+            case '"':  out.put('"'); break;
+            case '\\': out.put('\\'); break;
+            case '/':  out.put('/'); break;
+            case 'b':  out.put('\b'); break;
+            case 'f':  out.put('\f'); break;
+            case 'n':  out.put('\n'); break;
+            case 'r':  out.put('\r'); break;
+            case 't':  out.put('\t'); break;
+            case 'u':
+            {
+                long code = end - bytes >= 6 ? read_hex4(bytes + 2) : -1;
+                if (code < 0 || (code >= 0xDC00 && code <= 0xDFFF))
+                {
+                    return false;
+                }
+                if (code >= 0xD800 && code <= 0xDBFF)
+                {
+                    // a high surrogate must be followed by an escaped low one
+                    long low = end - bytes >= 12 && bytes[6] == '\\' && bytes[7] == 'u' ? read_hex4(bytes + 8) : -1;
+                    if (low < 0xDC00 || low > 0xDFFF)
+                    {
+                        return false;
+                    }
+                    code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+                    bytes += 6;
+                }
+
+                char seq[4];
+                out.append(seq, encode_char((char32_t)code, seq));
+                bytes += 4;
+                break;
+            }
+            default:
+                return false;
+        }
+        bytes += 2;
+        run = bytes;
+    }
+
+    out.append(run, bytes - run);
+    return true;
+}
+
+size_t utf8::json_escape(const char* src, size_t len, char* dst, const std::string& replacement)
+{
+    buffer_writer out{dst};
+    json_escape_to((const unsigned char*)src, len, replacement, out);
+    return out.pos - dst;
+}
+
+std::string utf8::json_escape(const std::string& src, const std::string& replacement)
+{
+    std::string res;
+    res.reserve(src.length() + src.length() / 8);
+    string_writer out{res};
+    json_escape_to((const unsigned char*)src.data(), src.length(), replacement, out);
+    return res;
+}
+
+bool utf8::json_unescape(const char* src, size_t len, char* dst, size_t& dst_len)
+{
+    buffer_writer out{dst};
+    bool res = json_unescape_to((const unsigned char*)src, len, out);
+    dst_len = out.pos - dst;
+    return res;
+}
+
+bool utf8::json_unescape(const std::string& src, std::string& dst)
+{
+    dst.clear();
+    dst.reserve(src.length());
+    string_writer out{dst};
+    return json_unescape_to((const unsigned char*)src.data(), src.length(), out);
+}
+
+//
+// Searching for characters of a set
+//
+
+utf8::codepoint_set::codepoint_set(std::initializer_list<char32_t> codes)
+{
+    for (char32_t code : codes)
+    {
+        add(code);
+    }
+}
+
+utf8::codepoint_set::codepoint_set(std::string_view chars)
+{
+    const unsigned char* bytes = (const unsigned char*)chars.data();
+    const unsigned char* end = bytes + chars.size();
+    int num_bytes;
+
+    while (bytes < end)
+    {
+        if (next_sequence(bytes, end - bytes, num_bytes))
+        {
+            add(decode_sequence(bytes, num_bytes));
+        }
+        bytes += num_bytes;
+    }
+}
+
+void utf8::codepoint_set::add(char32_t code)
+{
+    if (code > 0x10FFFF || (code >= 0xD800 && code <= 0xDFFF) || contains(code))
+    {
+        return;
+    }
+
+    char seq[4];
+    encode_char(code, seq);
+    unsigned char lead = (unsigned char)seq[0];
+
+    if (code < 0x80)
+    {
+        ascii_[code >> 6] |= 1ull << (code & 63);
+    }
+    else
+    {
+        multibyte_.insert(std::lower_bound(multibyte_.begin(), multibyte_.end(), code), code);
+    }
+
+    if (!is_candidate(lead))
+    {
+        candidates_[lead >> 6] |= 1ull << (lead & 63);
+        int range = lead >= 0x80;
+        if (lead < low_[range]) low_[range] = lead;
+        if (lead > high_[range]) high_[range] = lead;
+        if (num_probes_ < MAX_PROBES)
+        {
+            probes_[num_probes_] = lead;
+        }
+        num_probes_++;
+    }
+}
+
+bool utf8::codepoint_set::contains(char32_t code) const
+{
+    if (code < 0x80)
+    {
+        return (ascii_[code >> 6] >> (code & 63)) & 1;
+    }
+    return std::binary_search(multibyte_.begin(), multibyte_.end(), code);
+}
+
+int utf8::codepoint_set::match(const unsigned char* bytes, size_t avail) const
+{
+    if (*bytes < 0x80)
+    {
+        return contains(*bytes) ? 1 : 0;
+    }
+
+    // split like the other functions: a candidate byte is never inside an ill-formed part
+    int num_bytes;
+    if (!next_sequence(bytes, avail, num_bytes))
+    {
+        return 0;
+    }
+    return contains(decode_sequence(bytes, num_bytes)) ? num_bytes : 0;
+}
+
+size_t utf8::find_first_of(std::string_view str, const codepoint_set& set, size_t pos)
+{
+    if (pos >= str.size() || set.num_probes_ == 0)
+    {
+        return std::string_view::npos;
+    }
+
+    const unsigned char* start = (const unsigned char*)str.data();
+    const unsigned char* end = start + str.size();
+    const unsigned char* bytes = start + pos;
+    const bool use_probes = set.num_probes_ <= codepoint_set::MAX_PROBES;
+    const bool ascii = set.low_[0] <= set.high_[0];
+    const bool multibyte = set.low_[1] <= set.high_[1];
+
+    while (bytes < end)
+    {
+        // skip words without any candidate byte
+        if (use_probes)
+        {
+            while (end - bytes >= 8)
+            {
+                uint64_t word = load_word(bytes);
+                uint64_t found = 0;
+                for (int i = 0; i < set.num_probes_; ++i)
+                {
+                    found |= has_byte(word, set.probes_[i]);
+                }
+                if (found)
+                {
+                    break;
+                }
+                bytes += 8;
+            }
+        }
+        // too many candidates to probe: skip words without a byte in their ranges
+        else
+        {
+            while (end - bytes >= 8)
+            {
+                uint64_t word = load_word(bytes);
+                uint64_t found = 0;
+                if (ascii)
+                {
+                    found |= has_between(word, set.low_[0], set.high_[0]);
+                }
+                if (multibyte)
+                {
+                    // flipping the high bits makes the lead bytes ASCII and ASCII bytes high
+                    found |= has_between(word ^ HIGHS, set.low_[1] - 0x80, set.high_[1] - 0x80);
+                }
+                if (found)
+                {
+                    break;
+                }
+                bytes += 8;
+            }
+        }
+
+        // candidate bytes are ASCII or lead bytes, never trailing bytes of a sequence
+        const unsigned char* stop = end - bytes > 8 ? bytes + 8 : end;
+        for (; bytes < stop; ++bytes)
+        {
+            if (set.is_candidate(*bytes) && set.match(bytes, end - bytes))
+            {
+                return bytes - start;
+            }
+        }
+    }
+
+    return std::string_view::npos;
+}
+
+size_t utf8::find_first_not_of(std::string_view str, const codepoint_set& set, size_t pos)
+{
+    const unsigned char* start = (const unsigned char*)str.data();
+    const unsigned char* end = start + str.size();
+    const unsigned char* bytes = start + (pos < str.size() ? pos : str.size());
+
+    while (bytes < end)
+    {
+        int num_bytes = set.match(bytes, end - bytes);
+        if (num_bytes == 0)
+        {
+            return bytes - start;
+        }
+        bytes += num_bytes;
+    }
+
+    return std::string_view::npos;
+}
+
+size_t utf8::count_of(std::string_view str, const codepoint_set& set)
+{
+    size_t count = 0;
+    size_t pos = find_first_of(str, set);
+
+    while (pos != std::string_view::npos)
+    {
+        count++;
+        // trailing bytes of the found character are never candidates
+        pos = find_first_of(str, set, pos + 1);
+    }
+
+    return count;
+}
+
+//
+// Encoding detection
+//
+
+// Code points of bytes 80..FF
+static const char16_t CP1251_CHARS[128] = {
+    0x0402, 0x0403, 0x201A, 0x0453, 0x201E, 0x2026, 0x2020, 0x2021,
+    0x20AC, 0x2030, 0x0409, 0x2039, 0x040A, 0x040C, 0x040B, 0x040F,
+    0x0452, 0x2018, 0x2019, 0x201C, 0x201D, 0x2022, 0x2013, 0x2014,
+    0xFFFD, 0x2122, 0x0459, 0x203A, 0x045A, 0x045C, 0x045B, 0x045F,
+    0x00A0, 0x040E, 0x045E, 0x0408, 0x00A4, 0x0490, 0x00A6, 0x00A7,
+    0x0401, 0x00A9, 0x0404, 0x00AB, 0x00AC, 0x00AD, 0x00AE, 0x0407,
+    0x00B0, 0x00B1, 0x0406, 0x0456, 0x0491, 0x00B5, 0x00B6, 0x00B7,
+    0x0451, 0x2116, 0x0454, 0x00BB, 0x0458, 0x0405, 0x0455, 0x0457,
+    0x0410, 0x0411, 0x0412, 0x0413, 0x0414, 0x0415, 0x0416, 0x0417,
+    0x0418, 0x0419, 0x041A, 0x041B, 0x041C, 0x041D, 0x041E, 0x041F,
+    0x0420, 0x0421, 0x0422, 0x0423, 0x0424, 0x0425, 0x0426, 0x0427,
+    0x0428, 0x0429, 0x042A, 0x042B, 0x042C, 0x042D, 0x042E, 0x042F,
+    0x0430, 0x0431, 0x0432, 0x0433, 0x0434, 0x0435, 0x0436, 0x0437,
+    0x0438, 0x0439, 0x043A, 0x043B, 0x043C, 0x043D, 0x043E, 0x043F,
+    0x0440, 0x0441, 0x0442, 0x0443, 0x0444, 0x0445, 0x0446, 0x0447,
+    0x0448, 0x0449, 0x044A, 0x044B, 0x044C, 0x044D, 0x044E, 0x044F
+};
+
+static const char16_t KOI8R_CHARS[128] = {
+    0x2500, 0x2502, 0x250C, 0x2510, 0x2514, 0x2518, 0x251C, 0x2524,
+    0x252C, 0x2534, 0x253C, 0x2580, 0x2584, 0x2588, 0x258C, 0x2590,
+    0x2591, 0x2592, 0x2593, 0x2320, 0x25A0, 0x2219, 0x221A, 0x2248,
+    0x2264, 0x2265, 0x00A0, 0x2321, 0x00B0, 0x00B2, 0x00B7, 0x00F7,
+    0x2550, 0x2551, 0x2552, 0x0451, 0x2553, 0x2554, 0x2555, 0x2556,
+    0x2557, 0x2558, 0x2559, 0x255A, 0x255B, 0x255C, 0x255D, 0x255E,
+    0x255F, 0x2560, 0x2561, 0x0401, 0x2562, 0x2563, 0x2564, 0x2565,
+    0x2566, 0x2567, 0x2568, 0x2569, 0x256A, 0x256B, 0x256C, 0x00A9,
+    0x044E, 0x0430, 0x0431, 0x0446, 0x0434, 0x0435, 0x0444, 0x0433,
+    0x0445, 0x0438, 0x0439, 0x043A, 0x043B, 0x043C, 0x043D, 0x043E,
+    0x043F, 0x044F, 0x0440, 0x0441, 0x0442, 0x0443, 0x0436, 0x0432,
+    0x044C, 0x044B, 0x0437, 0x0448, 0x044D, 0x0449, 0x0447, 0x044A,
+    0x042E, 0x0410, 0x0411, 0x0426, 0x0414, 0x0415, 0x0424, 0x0413,
+    0x0425, 0x0418, 0x0419, 0x041A, 0x041B, 0x041C, 0x041D, 0x041E,
+    0x041F, 0x042F, 0x0420, 0x0421, 0x0422, 0x0423, 0x0416, 0x0412,
+    0x042C, 0x042B, 0x0417, 0x0428, 0x042D, 0x0429, 0x0427, 0x042A
+};
+
+// Frequent Russian letter pairs
+static const char RUSSIAN_BIGRAMS[] =
+    "ст но то на ен ов ни ра во ко ер ро по ре пр ал ли ор не ог та ет ос ан ле от ел ол ла "
+    "ин ва го ом ит ка ло ть ат ес ки ль ти ие ны ри од ак ам де ми ем ое их ся за ий ой ый ая "
+    "ве ди ск ед ег ме ту ру мо об из аз ял уд ус ша чт ще ье ча";
+
+static const int SAMPLE_CHUNK = 4096;
+static const int SAMPLE_CHUNKS = 16;
+
+// The 8-bit encodings scored by letter pairs
+static const int NUM_CODEPAGES = 3;
+static const utf8::encoding CODEPAGES[NUM_CODEPAGES] = {
+    utf8::encoding::cp1251, utf8::encoding::koi8r, utf8::encoding::latin1
+};
+
+static inline char32_t codepage_char(int codepage, unsigned char c)
+{
+    if (c < 0x80 || codepage == 2)
+    {
+        return c;
+    }
+    return codepage == 0 ? CP1251_CHARS[c - 0x80] : KOI8R_CHARS[c - 0x80];
+}
+
+enum char_kind { KIND_OTHER, KIND_BAD, KIND_CYR_LOWER, KIND_CYR_UPPER, KIND_LAT_LOWER, KIND_LAT_UPPER };
+
+static inline char_kind classify(char32_t code)
+{
+    if (code < 0x80)
+    {
+        if (code >= 'a' && code <= 'z') return KIND_LAT_LOWER;
+        if (code >= 'A' && code <= 'Z') return KIND_LAT_UPPER;
+        return KIND_OTHER;
+    }
+    if (code >= 0x430 && code <= 0x44F) return KIND_CYR_LOWER;
+    if (code >= 0x410 && code <= 0x42F) return KIND_CYR_UPPER;
+    if (code == 0x451) return KIND_CYR_LOWER;
+    if (code == 0x401) return KIND_CYR_UPPER;
+    if (code >= 0xDF && code <= 0xFF && code != 0xF7) return KIND_LAT_LOWER;
+    if (code >= 0xC0 && code <= 0xDE && code != 0xD7) return KIND_LAT_UPPER;
+    // C1 controls, undefined bytes and box drawing are not expected in text
+    if (code < 0xA0 || code == 0xFFFD || (code >= 0x2219 && code <= 0x25FF)) return KIND_BAD;
+    return KIND_OTHER;
+}
+
+// Index of a Cyrillic letter in the bigram table, ё is counted as е
+static inline int cyrillic_index(char32_t code)
+{
+    if (code == 0x451 || code == 0x401) return 5;
+    return code >= 0x430 ? code - 0x430 : code - 0x410;
+}
+
+struct bigram_table
+{
+    uint32_t rows[32] = {};
+
+    bigram_table()
+    {
+        const unsigned char* bytes = (const unsigned char*)RUSSIAN_BIGRAMS;
+        while (*bytes)
+        {
+            char32_t first = decode_sequence(bytes, 2);
+            char32_t second = decode_sequence(bytes + 2, 2);
+            rows[cyrillic_index(first)] |= 1u << cyrillic_index(second);
+            bytes += 4;
+            while (*bytes == ' ') bytes++;
+        }
+    }
+};
+
+static const uint32_t* russian_bigrams()
+{
+    static const bigram_table table;
+    return table.rows;
+}
+
+// Plausibility of two adjacent characters of a text
+static double pair_score(char32_t first, char32_t second, const uint32_t* bigrams)
+{
+    char_kind k1 = classify(first);
+    char_kind k2 = classify(second);
+
+    if (k1 == KIND_BAD || k2 == KIND_BAD) return -2.0;
+    if (k1 == KIND_OTHER || k2 == KIND_OTHER) return 0.0;
+
+    bool cyr1 = k1 == KIND_CYR_LOWER || k1 == KIND_CYR_UPPER;
+    bool cyr2 = k2 == KIND_CYR_LOWER || k2 == KIND_CYR_UPPER;
+    bool lower1 = k1 == KIND_CYR_LOWER || k1 == KIND_LAT_LOWER;
+    bool lower2 = k2 == KIND_CYR_LOWER || k2 == KIND_LAT_LOWER;
+
+    // words rarely mix scripts
+    if (cyr1 != cyr2) return -2.0;
+
+    double score = 1.0;
+    if (lower1 && lower2) score += 0.5;
+    else if (lower1 && !lower2) score -= 1.5;
+
+    if (cyr1)
+    {
+        if ((bigrams[cyrillic_index(first)] >> cyrillic_index(second)) & 1) score += 1.0;
+    }
+    else if (first >= 0x80 && second >= 0x80)
+    {
+        // accented Latin letters are seldom adjacent
+        score -= 1.5;
+    }
+    return score;
+}
+
+struct detect_stats
+{
+    size_t bytes = 0;
+    size_t utf8_multibyte = 0;
+    size_t utf8_errors = 0;
+    size_t utf16_le = 0;    // 00 or 04 at odd offsets, the high bytes of ASCII and Cyrillic in UTF-16LE
+    size_t utf16_be = 0;    // the same at even offsets
+    size_t pairs = 0;
+    double scores[NUM_CODEPAGES] = {};
+};
+
+// Collects UTF-8, UTF-16 and letter pair statistics of a chunk in one pass
+static void detect_chunk(const unsigned char* data, size_t begin, size_t end, size_t size,
+                         detect_stats& stats, const uint32_t* bigrams)
+{
+    size_t pos = begin;
+    // a chunk may start in the middle of a sequence
+    if (begin > 0)
+    {
+        for (int i = 0; i < 3 && pos < end && (data[pos] & 0xC0) == 0x80; ++i) pos++;
+    }
+
+    size_t utf8_next = pos;
+    unsigned char prev = 0;
+    int num_bytes;
+
+    stats.bytes += end - pos;
+    while (pos < end)
+    {
+        // skip ASCII text without zero bytes
+        if (prev < 0x80 && pos == utf8_next && end - pos >= 8)
+        {
+            uint64_t word = load_word(data + pos);
+            if (!((word & HIGHS) | has_less(word, 0x05)))
+            {
+                pos += 8;
+                utf8_next = pos;
+                prev = data[pos - 1];
+                continue;
+            }
+        }
+
+        unsigned char c = data[pos];
+        if (c == 0x00 || c == 0x04)
+        {
+            if (pos & 1) stats.utf16_le++;
+            else stats.utf16_be++;
+        }
+
+        if (pos == utf8_next)
+        {
+            if (c < 0x80)
+            {
+                utf8_next++;
+            }
+            else
+            {
+                // a sequence may continue past the end of the chunk
+                if (check_sequence(data + pos, size - pos, num_bytes)) stats.utf8_multibyte++;
+                else stats.utf8_errors++;
+                utf8_next += num_bytes;
+            }
+        }
+
+        if (pos > begin && ((prev | c) & 0x80))
+        {
+            stats.pairs++;
+            for (int i = 0; i < NUM_CODEPAGES; ++i)
+            {
+                stats.scores[i] += pair_score(codepage_char(i, prev), codepage_char(i, c), bigrams);
+            }
+        }
+
+        prev = c;
+        pos++;
+    }
+}
+
+static inline double clamp_confidence(double value)
+{
+    return value < 0.0 ? 0.0 : (value > 1.0 ? 1.0 : value);
+}
+
+utf8::encoding_info utf8::detect_encoding(std::string_view buffer)
+{
+    const unsigned char* data = (const unsigned char*)buffer.data();
+    const size_t size = buffer.size();
+
+    if (size >= 3 && data[0] == 0xEF && data[1] == 0xBB && data[2] == 0xBF)
+    {
+        return {encoding::utf8, 1.0, 3};
+    }
+    if (size >= 2 && data[0] == 0xFF && data[1] == 0xFE)
+    {
+        return {encoding::utf16le, 1.0, 2};
+    }
+    if (size >= 2 && data[0] == 0xFE && data[1] == 0xFF)
+    {
+        return {encoding::utf16be, 1.0, 2};
+    }
+
+    detect_stats stats;
+    const uint32_t* bigrams = russian_bigrams();
+
+    if (size <= (size_t)SAMPLE_CHUNK * SAMPLE_CHUNKS)
+    {
+        detect_chunk(data, 0, size, size, stats, bigrams);
+    }
+    else
+    {
+        // spread the chunks over the buffer, keeping them at even offsets for UTF-16
+        size_t step = (size - SAMPLE_CHUNK) / (SAMPLE_CHUNKS - 1) & ~(size_t)1;
+        for (int i = 0; i < SAMPLE_CHUNKS; ++i)
+        {
+            size_t begin = step * i;
+            detect_chunk(data, begin, begin + SAMPLE_CHUNK, size, stats, bigrams);
+        }
+    }
+
+    size_t units = stats.bytes / 2;
+    if (units > 0 && stats.utf16_le * 2 > units && stats.utf16_be * 8 < stats.utf16_le)
+    {
+        return {encoding::utf16le, clamp_confidence((double)(stats.utf16_le - stats.utf16_be) / (double)units), 0};
+    }
+    if (units > 0 && stats.utf16_be * 2 > units && stats.utf16_le * 8 < stats.utf16_be)
+    {
+        return {encoding::utf16be, clamp_confidence((double)(stats.utf16_be - stats.utf16_le) / (double)units), 0};
+    }
+
+    // validity of the sampled bytes says nothing about the rest of the buffer
+    const double coverage = size ? (double)stats.bytes / (double)size : 1.0;
+
+    if (stats.utf8_errors == 0)
+    {
+        // every valid multibyte sequence makes an 8-bit encoding less likely
+        int evidence = stats.utf8_multibyte < 16 ? (int)stats.utf8_multibyte : 16;
+        return {encoding::utf8, (stats.utf8_multibyte ? 1.0 - std::ldexp(1.0, -evidence - 1) : 1.0) * coverage, 0};
+    }
+    if (stats.utf8_multibyte > stats.utf8_errors * 16)
+    {
+        double valid = (double)stats.utf8_multibyte / (double)(stats.utf8_multibyte + stats.utf8_errors);
+        return {encoding::utf8, valid * coverage, 0};
+    }
+
+    // too short to score any letter pair
+    if (stats.pairs == 0)
+    {
+        return {encoding::unknown, 0.0, 0};
+    }
+
+    int best = 0, second = -1;
+    for (int i = 1; i < NUM_CODEPAGES; ++i)
+    {
+        if (stats.scores[i] > stats.scores[best])
+        {
+            second = best;
+            best = i;
+        }
+        else if (second < 0 || stats.scores[i] > stats.scores[second])
+        {
+            second = i;
+        }
+    }
+
+    double margin = (stats.scores[best] - stats.scores[second]) / (double)stats.pairs;
+    double sample = stats.pairs < 16 ? (double)stats.pairs / 16.0 : 1.0;
+    return {CODEPAGES[best], clamp_confidence(margin) * sample, 0};
+}
+
+std::string utf8::to_utf8(std::string_view buffer, encoding type)
+{
+    const unsigned char* bytes = (const unsigned char*)buffer.data();
+    const unsigned char* end = bytes + buffer.size();
+    std::string res;
+    string_writer out{res};
+    char seq[4];
+
+    switch (type)
+    {
+        case encoding::utf16le:
+        case encoding::utf16be:
+        {
+            const int high = type == encoding::utf16le ? 1 : 0;
+            if (end - bytes >= 2 && (bytes[high] << 8 | bytes[1 - high]) == 0xFEFF)
+            {
+                bytes += 2;
+            }
+            res.reserve(buffer.size() + buffer.size() / 2);
+            while (end - bytes >= 2)
+            {
+                char32_t code = bytes[high] << 8 | bytes[1 - high];
+                bytes += 2;
+                if (code >= 0xD800 && code <= 0xDBFF && end - bytes >= 2)
+                {
+                    char32_t low = bytes[high] << 8 | bytes[1 - high];
+                    if (low >= 0xDC00 && low <= 0xDFFF)
+                    {
+                        code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+                        bytes += 2;
+                    }
+                }
+                if (code >= 0xD800 && code <= 0xDFFF)
+                {
+                    code = 0xFFFD;
+                }
+                out.append(seq, encode_char(code, seq));
+            }
+            if (bytes < end)
+            {
+                out.append("\xEF\xBF\xBD", 3);
+            }
+            break;
+        }
+        case encoding::cp1251:
+        case encoding::koi8r:
+        case encoding::latin1:
+        {
+            const int codepage = type == encoding::cp1251 ? 0 : (type == encoding::koi8r ? 1 : 2);
+            res.reserve(buffer.size() * 2);
+            const unsigned char* run = bytes; // ASCII bytes not written yet
+            while (bytes < end)
+            {
+                while (end - bytes >= 8 && !(load_word(bytes) & HIGHS))
+                {
+                    bytes += 8;
+                }
+                if (bytes == end)
+                {
+                    break;
+                }
+                if (*bytes < 0x80)
+                {
+                    bytes++;
+                    continue;
+                }
+                out.append(run, bytes - run);
+                out.append(seq, encode_char(codepage_char(codepage, *bytes), seq));
+                bytes++;
+                run = bytes;
+            }
+            out.append(run, bytes - run);
+            break;
+        }
+        default:
+        {
+            if (end - bytes >= 3 && bytes[0] == 0xEF && bytes[1] == 0xBB && bytes[2] == 0xBF)
+            {
+                bytes += 3;
+            }
+            res.reserve(end - bytes);
+            sanitize_to(bytes, end - bytes, "\xEF\xBF\xBD", sanitize_policy(), out);
+        }
+    }
+
+    return res;
+}
+
+//
+// Pipeline
+//
+
+size_t utf8::detail::decode_block(const char*& src, const char* end, char32_t* dst, size_t max)
+{
+    const unsigned char* bytes = (const unsigned char*)src;
+    const unsigned char* stop = (const unsigned char*)end;
+    size_t size = 0;
+    int num_bytes;
+
+    while (size < max && bytes < stop)
+    {
+        if (*bytes < 0x80)
+        {
+            dst[size++] = *bytes++;
+        }
+        else
+        {
+            bool valid = next_sequence(bytes, stop - bytes, num_bytes);
+            dst[size++] = valid ? decode_sequence(bytes, num_bytes) : invalid_char;
+            bytes += num_bytes;
+        }
+    }
+
+    src = (const char*)bytes;
+    return size;
+}
+
+void utf8::detail::encode_block(const char32_t* src, size_t len, std::string& dst)
+{
+    char buf[block_sink::BLOCK_SIZE * 4];
+    size_t size = 0;
+
+    for (size_t i = 0; i < len; ++i)
+    {
+        if (size + 4 > sizeof(buf))
+        {
+            dst.append(buf, size);
+            size = 0;
+        }
+        if (src[i] != invalid_char)
+        {
+            size += encode_char(src[i], buf + size);
+        }
+    }
+
+    dst.append(buf, size);
+}
+
+utf8::stage::repair::repair(std::string_view replacement)
+{
+    const char* bytes = replacement.data();
+    const char* end = bytes + replacement.size();
+    char32_t block[16];
+
+    while (bytes < end)
+    {
+        size_t size = detail::decode_block(bytes, end, block, 16);
+        for (size_t i = 0; i < size; ++i)
+        {
+            if (block[i] != invalid_char)
+            {
+                replacement_ += block[i];
+            }
+        }
+    }
+}
+
+//
+// Collation
+//
+// Every character gets up to two collation elements of three levels. Key layout:
+//   primary weights (2 bytes each) 01 secondary weights 01 tertiary weights
+// Trailing common secondary and tertiary weights are dropped, as the separator
+// sorts below any weight.
+//
+
+struct collation_element
+{
+    uint16_t primary;
+    unsigned char secondary;
+    unsigned char tertiary;
+};
+
+static const unsigned char LEVEL_SEPARATOR = 0x01;
+static const unsigned char COMMON_WEIGHT = 0x05;
+static const unsigned char UPPER_WEIGHT = 0x06;
+static const unsigned char VARIANT_WEIGHT = 0x07;   // superscripts and fractions
+
+static const uint16_t SPACE_PRIMARY = 0x0200;
+static const uint16_t PUNCT_PRIMARY = 0x0300;
+static const uint16_t SYMBOL_PRIMARY = 0x0400;
+static const uint16_t DIGIT_PRIMARY = 0x1000;
+static const uint16_t LATIN_PRIMARY = 0x2000;
+static const uint16_t GREEK_PRIMARY = 0x2800;
+static const uint16_t CYRILLIC_PRIMARY = 0x3000;
+static const uint16_t IMPLICIT_PRIMARY = 0xF000;
+
+// DUCET order of ASCII punctuation and symbols
+static const char ASCII_PUNCTUATION[] = "_-,;:!?.'\"()[]{}@*/\\&#%`^+<=>|~$";
+
+// Secondary weights of diacritics, in DUCET order
+enum : unsigned char
+{
+    ACUTE = COMMON_WEIGHT + 1, GRAVE, CIRCUMFLEX, RING, DIAERESIS, TILDE, CEDILLA, STROKE
+};
+
+// Base letters and diacritics of U+00C0..U+00DE; '*' marks characters handled separately
+static const char LATIN1_BASES[] = "AAAAAA*CEEEEIIIIDNOOOOO*OUUUUY*";
+static const unsigned char LATIN1_MARKS[] = {
+    GRAVE, ACUTE, CIRCUMFLEX, TILDE, DIAERESIS, RING, 0, CEDILLA,
+    GRAVE, ACUTE, CIRCUMFLEX, DIAERESIS, GRAVE, ACUTE, CIRCUMFLEX, DIAERESIS,
+    STROKE, TILDE, GRAVE, ACUTE, CIRCUMFLEX, TILDE, DIAERESIS, 0,
+    STROKE, GRAVE, ACUTE, CIRCUMFLEX, DIAERESIS, ACUTE, 0
+};
+
+static inline bool is_ignorable(char32_t code)
+{
+    return (code < 0x20 && !utf8::is_space(code)) || (code >= 0x7F && code < 0xA0 && code != 0x85) ||
+        code == 0xAD || (code >= 0x200B && code <= 0x200F) || (code >= 0x202A && code <= 0x202E) ||
+        (code >= 0x2060 && code <= 0x206F) || code == 0xFEFF;
+}
+
+static inline collation_element latin_element(char letter, unsigned char mark, bool upper)
+{
+    return {(uint16_t)(LATIN_PRIMARY + (letter | 0x20) - 'a'), mark ? mark : COMMON_WEIGHT, upper ? UPPER_WEIGHT : COMMON_WEIGHT};
+}
+
+// Returns the number of collation elements of a character, 0 for ignorable ones
+static int collation_elements(char32_t code, collation_element* elements)
+{
+    if (is_ignorable(code))
+    {
+        return 0;
+    }
+
+    char32_t lower = utf8::to_lower(code);
+    unsigned char tertiary = lower != code ? UPPER_WEIGHT : COMMON_WEIGHT;
+
+    if (utf8::is_space(code))
+    {
+        elements[0] = {(uint16_t)(SPACE_PRIMARY + (code < 0x80 ? code : 0x80 + (code & 0x7F))), COMMON_WEIGHT, COMMON_WEIGHT};
+        return 1;
+    }
+    if (code < 0x80)
+    {
+        if (lower >= 'a' && lower <= 'z')
+        {
+            elements[0] = latin_element((char)lower, 0, tertiary == UPPER_WEIGHT);
+        }
+        else if (code >= '0' && code <= '9')
+        {
+            elements[0] = {(uint16_t)(DIGIT_PRIMARY + code - '0'), COMMON_WEIGHT, COMMON_WEIGHT};
+        }
+        else
+        {
+            const char* punct = strchr(ASCII_PUNCTUATION, (char)code);
+            elements[0] = {(uint16_t)(PUNCT_PRIMARY + (punct - ASCII_PUNCTUATION)), COMMON_WEIGHT, COMMON_WEIGHT};
+        }
+        return 1;
+    }
+    if (code >= 0xC0 && code <= 0xFF && code != 0xD7 && code != 0xF7)
+    {
+        bool upper = code < 0xDF;
+        int index = (code & ~0x20) - 0xC0;
+        switch (code)
+        {
+            case 0xC6: case 0xE6: // Æ, æ
+                elements[0] = latin_element('a', 0, upper);
+                elements[1] = latin_element('e', 0, upper);
+                return 2;
+            case 0xDE: case 0xFE: // Þ, þ follow z
+                elements[0] = {(uint16_t)(LATIN_PRIMARY + 26), COMMON_WEIGHT, upper ? UPPER_WEIGHT : COMMON_WEIGHT};
+                return 1;
+            case 0xDF: // ß
+                elements[0] = latin_element('s', 0, false);
+                elements[1] = latin_element('s', 0, false);
+                return 2;
+            case 0xFF: // ÿ
+                elements[0] = latin_element('y', DIAERESIS, false);
+                return 1;
+        }
+        elements[0] = latin_element(LATIN1_BASES[index], LATIN1_MARKS[index], upper);
+        return 1;
+    }
+    if (code >= 0xA0 && code < 0xC0)
+    {
+        switch (code)
+        {
+            case 0xAA: // ª
+            case 0xBA: // º
+                elements[0] = latin_element(code == 0xAA ? 'a' : 'o', 0, false);
+                elements[0].tertiary = VARIANT_WEIGHT;
+                return 1;
+            case 0xB5: // µ is the Greek mu
+                elements[0] = {(uint16_t)(GREEK_PRIMARY + 0x03BC - 0x03B1), COMMON_WEIGHT, VARIANT_WEIGHT};
+                return 1;
+            case 0xB2: case 0xB3: case 0xB9: // ², ³, ¹
+                elements[0] = {(uint16_t)(DIGIT_PRIMARY + (code == 0xB9 ? 1 : code - 0xB0)), COMMON_WEIGHT, VARIANT_WEIGHT};
+                return 1;
+            case 0xBC: case 0xBD: case 0xBE: // ¼, ½, ¾ expand to digit, fraction slash, digit
+            {
+                static const char FRACTIONS[][2] = {{1, 4}, {1, 2}, {3, 4}};
+                const char* digits = FRACTIONS[code - 0xBC];
+                elements[0] = {(uint16_t)(DIGIT_PRIMARY + digits[0]), COMMON_WEIGHT, VARIANT_WEIGHT};
+                elements[1] = {(uint16_t)(SYMBOL_PRIMARY + 0x20 + 0x2044 - 0x2010), COMMON_WEIGHT, VARIANT_WEIGHT};
+                elements[2] = {(uint16_t)(DIGIT_PRIMARY + digits[1]), COMMON_WEIGHT, VARIANT_WEIGHT};
+                return 3;
+            }
+        }
+        elements[0] = {(uint16_t)(SYMBOL_PRIMARY + code - 0xA0), COMMON_WEIGHT, COMMON_WEIGHT};
+        return 1;
+    }
+    if (lower >= 0x0430 && lower <= 0x044F)
+    {
+        elements[0] = {(uint16_t)(CYRILLIC_PRIMARY + 2 * (lower - 0x0430)), COMMON_WEIGHT, tertiary};
+        return 1;
+    }
+    if (lower == 0x0451) // ё is е with a diaeresis
+    {
+        elements[0] = {(uint16_t)(CYRILLIC_PRIMARY + 2 * (0x0435 - 0x0430)), DIAERESIS, tertiary};
+        return 1;
+    }
+    if (code >= 0x2010 && code <= 0x205E)
+    {
+        elements[0] = {(uint16_t)(SYMBOL_PRIMARY + 0x20 + code - 0x2010), COMMON_WEIGHT, COMMON_WEIGHT};
+        return 1;
+    }
+
+    // implicit weights keep the code point order
+    elements[0] = {(uint16_t)(IMPLICIT_PRIMARY + (code >> 15)), COMMON_WEIGHT, COMMON_WEIGHT};
+    elements[1] = {(uint16_t)(0x8000 | (code & 0x7FFF)), COMMON_WEIGHT, COMMON_WEIGHT};
+    return 2;
+}
+
+void utf8::sort_key(std::string_view str, collation_strength strength, std::string& key)
+{
+    const unsigned char* start = (const unsigned char*)str.data();
+    const unsigned char* end = start + str.size();
+    collation_element elements[3];
+    int num_bytes;
+
+    key.clear();
+    key.reserve(str.size() * 2 + 2);
+
+    for (int level = 1; level <= (int)strength; ++level)
+    {
+        if (level > 1)
+        {
+            key += (char)LEVEL_SEPARATOR;
+        }
+        size_t significant = key.size();
+
+        for (const unsigned char* bytes = start; bytes < end; bytes += num_bytes)
+        {
+            char32_t code = check_sequence(bytes, end - bytes, num_bytes) ? decode_sequence(bytes, num_bytes) : 0xFFFD;
+            int count = collation_elements(code, elements);
+            for (int i = 0; i < count; ++i)
+            {
+                if (level == 1)
+                {
+                    key += (char)(elements[i].primary >> 8);
+                    key += (char)(elements[i].primary & 0xFF);
+                    continue;
+                }
+                unsigned char weight = level == 2 ? elements[i].secondary : elements[i].tertiary;
+                key += (char)weight;
+                if (weight != COMMON_WEIGHT)
+                {
+                    significant = key.size();
+                }
+            }
+        }
+
+        if (level > 1)
+        {
+            key.resize(significant);
+        }
+    }
+}
+
+std::string utf8::sort_key(std::string_view str, collation_strength strength)
+{
+    std::string key;
+    sort_key(str, strength, key);
+    return key;
+}
+
+//
+// Character properties
+//
+
+#include "utf8_properties.inc"
+
+static inline unsigned char properties(char32_t code)
+{
+    if (code > 0x10FFFF)
+    {
+        return 0;
+    }
+    return PROPERTY_BLOCKS[PROPERTY_STAGE1[code >> PROPERTY_BLOCK_SHIFT]][code & ((1 << PROPERTY_BLOCK_SHIFT) - 1)];
+}
+
+utf8::general_category utf8::category(char32_t code)
+{
+    return (general_category)(properties(code) & PROPERTY_CATEGORY);
+}
+
+bool utf8::is_space(char32_t code)
+{
+    return (properties(code) & PROPERTY_WHITE_SPACE) != 0;
+}
+
+bool utf8::is_alpha(char32_t code)
+{
+    return (properties(code) & PROPERTY_ALPHABETIC) != 0;
+}
+
+// True if the character at `bytes` is white space, `num_bytes` receives its length
+static inline bool space_at(const unsigned char* bytes, const unsigned char* end, int& num_bytes)
+{
+    if (*bytes < 0x80)
+    {
+        num_bytes = 1;
+        return *bytes == ' ' || (*bytes >= '\t' && *bytes <= '\r');
+    }
+    return next_sequence(bytes, end - bytes, num_bytes) && utf8::is_space(decode_sequence(bytes, num_bytes));
+}
+
+// Returns the first white space character at or after `bytes`
+static const unsigned char* find_space(const unsigned char* bytes, const unsigned char* end)
+{
+    int num_bytes;
+
+    while (bytes < end)
+    {
+        // ASCII above U+0020 is never white space
+        while (end - bytes >= 8)
+        {
+            uint64_t word = load_word(bytes);
+            if ((word & HIGHS) | has_less(word, 0x21))
+            {
+                break;
+            }
+            bytes += 8;
+        }
+        if (bytes == end)
+        {
+            break;
+        }
+        if (space_at(bytes, end, num_bytes))
+        {
+            return bytes;
+        }
+        bytes += num_bytes;
+    }
+
+    return end;
+}
+
+// Returns the first character at or after `bytes` that is not white space
+static const unsigned char* skip_space(const unsigned char* bytes, const unsigned char* end)
+{
+    int num_bytes;
+
+    while (bytes < end)
+    {
+        while (end - bytes >= 8 && load_word(bytes) == ONES * ' ')
+        {
+            bytes += 8;
+        }
+        if (bytes == end || !space_at(bytes, end, num_bytes))
+        {
+            break;
+        }
+        bytes += num_bytes;
+    }
+
+    return bytes;
+}
+
+std::string_view utf8::trim(std::string_view str)
+{
+    const unsigned char* start = (const unsigned char*)str.data();
+    const unsigned char* end = start + str.size();
+    const unsigned char* first = skip_space(start, end);
+    const unsigned char* last = end;
+    int num_bytes;
+
+    while (last > first)
+    {
+        // step back to the first byte of the last character
+        const unsigned char* pos = last - 1;
+        while (pos > first && last - pos < 4 && (*pos & 0xC0) == 0x80)
+        {
+            pos--;
+        }
+        if (!space_at(pos, last, num_bytes) || pos + num_bytes != last)
+        {
+            break;
+        }
+        last = pos;
+    }
+
+    return str.substr(first - start, last - first);
+}
+
+std::string_view utf8::collapse_whitespace(std::string_view str, char* dst)
+{
+    const unsigned char* bytes = (const unsigned char*)str.data();
+    const unsigned char* end = bytes + str.size();
+    char* out = dst;
+
+    while (bytes < end)
+    {
+        const unsigned char* space = find_space(bytes, end);
+        // dst may overlap the source
+        memmove(out, bytes, space - bytes);
+        out += space - bytes;
+        if (space == end)
+        {
+            break;
+        }
+        // skip before writing: in place the space overwrites the lead byte of a multibyte one
+        const unsigned char* next = skip_space(space, end);
+        *out++ = ' ';
+        bytes = next;
+    }
+
+    return std::string_view(dst, out - dst);
+}
+
+bool utf8::detail::next_word(std::string_view& rest, std::string_view& word)
+{
+    const unsigned char* start = (const unsigned char*)rest.data();
+    const unsigned char* end = start + rest.size();
+    const unsigned char* first = skip_space(start, end);
+
+    if (first == end)
+    {
+        return false;
+    }
+
+    const unsigned char* last = find_space(first, end);
+    word = rest.substr(first - start, last - first);
+    rest = rest.substr(last - start);
+    return true;
+}
+
+//
+// Edit distance
+//
+// Myers' bit-vector algorithm: column j of the dynamic programming matrix is kept as
+// bit vectors of vertical deltas (Pv: +1, Mv: -1), a text character updates all of them
+// with a few word operations. Patterns longer than 64 characters are split into blocks,
+// the horizontal delta of the last row of a block is carried into the next one.
+//
+
+static const uint64_t LAST_BIT = 1ull << 63;
+
+// Processes one text character in one block, returns the horizontal delta of its last row
+static inline int advance_block(uint64_t& pv, uint64_t& mv, uint64_t eq, int hin, uint64_t last_bit)
+{
+    uint64_t xv = eq | mv;
+    if (hin < 0)
+    {
+        eq |= 1;
+    }
+    uint64_t xh = (((eq & pv) + pv) ^ pv) | eq;
+    uint64_t ph = mv | ~(xh | pv);
+    uint64_t mh = pv & xh;
+
+    int hout = (ph & last_bit) ? 1 : ((mh & last_bit) ? -1 : 0);
+
+    ph <<= 1;
+    mh <<= 1;
+    if (hin < 0)
+    {
+        mh |= 1;
+    }
+    else if (hin > 0)
+    {
+        ph |= 1;
+    }
+    pv = mh | ~(xv | ph);
+    mv = ph & xv;
+    return hout;
+}
+
+// Number of characters, each ill-formed sequence is one character
+static size_t count_chars(const unsigned char* bytes, const unsigned char* end)
+{
+    size_t count = 0;
+    int num_bytes;
+
+    while (bytes < end)
+    {
+        while (end - bytes >= 8 && !(load_word(bytes) & HIGHS))
+        {
+            bytes += 8;
+            count += 8;
+        }
+        if (bytes == end)
+        {
+            break;
+        }
+        next_sequence(bytes, end - bytes, num_bytes);
+        bytes += num_bytes;
+        count++;
+    }
+
+    return count;
+}
+
+utf8::edit_pattern::edit_pattern(std::string_view pattern, bool ignore_case)
+    : ignore_case_(ignore_case)
+{
+    const char* bytes = pattern.data();
+    const char* end = bytes + pattern.size();
+    char32_t block[64];
+    std::vector<std::pair<char32_t, size_t>> others; // non-ASCII characters and their positions
+
+    length_ = count_chars((const unsigned char*)bytes, (const unsigned char*)end);
+    blocks_ = (length_ + 63) / 64;
+    ascii_masks_.assign(128 * blocks_, 0);
+
+    for (size_t pos = 0; bytes < end; )
+    {
+        size_t size = detail::decode_block(bytes, end, block, 64);
+        for (size_t i = 0; i < size; ++i, ++pos)
+        {
+            char32_t code = ignore_case_ ? to_lower(block[i]) : block[i];
+            if (code < 0x80)
+            {
+                ascii_masks_[code * blocks_ + pos / 64] |= 1ull << (pos % 64);
+            }
+            else if (code != invalid_char)
+            {
+                others.emplace_back(code, pos);
+            }
+        }
+    }
+
+    std::sort(others.begin(), others.end());
+    for (const auto& other : others)
+    {
+        if (codes_.empty() || codes_.back() != other.first)
+        {
+            codes_.push_back(other.first);
+            code_masks_.resize(code_masks_.size() + blocks_, 0);
+        }
+        code_masks_[code_masks_.size() - blocks_ + other.second / 64] |= 1ull << (other.second % 64);
+    }
+    code_masks_.resize(code_masks_.size() + blocks_, 0);
+}
+
+const uint64_t* utf8::edit_pattern::masks(char32_t code) const
+{
+    if (ignore_case_)
+    {
+        code = to_lower(code);
+    }
+    if (code < 0x80)
+    {
+        return &ascii_masks_[code * blocks_];
+    }
+    auto it = std::lower_bound(codes_.begin(), codes_.end(), code);
+    size_t index = it != codes_.end() && *it == code ? it - codes_.begin() : codes_.size();
+    return &code_masks_[index * blocks_];
+}
+
+size_t utf8::edit_pattern::distance(std::string_view text, size_t max) const
+{
+    const char* bytes = text.data();
+    const char* end = bytes + text.size();
+    const size_t length = count_chars((const unsigned char*)bytes, (const unsigned char*)end);
+
+    if ((length > length_ ? length - length_ : length_ - length) > max)
+    {
+        return max + 1;
+    }
+    if (length_ == 0)
+    {
+        return length;
+    }
+
+    // vertical deltas of all blocks, a column starts as 0, 1, 2, ...
+    std::vector<uint64_t> pv(blocks_, ~0ull);
+    std::vector<uint64_t> mv(blocks_, 0);
+    const uint64_t last_bit = 1ull << ((length_ - 1) % 64);
+    size_t score = length_;
+    size_t remaining = length;
+    char32_t block[256];
+
+    while (bytes < end)
+    {
+        size_t size = detail::decode_block(bytes, end, block, 256);
+        for (size_t i = 0; i < size; ++i)
+        {
+            const uint64_t* eq = masks(block[i]);
+            // the first row of the matrix grows by 1 in every column
+            int carry = 1;
+            for (size_t b = 0; b < blocks_; ++b)
+            {
+                carry = advance_block(pv[b], mv[b], eq[b], carry, b + 1 < blocks_ ? LAST_BIT : last_bit);
+            }
+            score += carry;
+
+            // the distance can decrease by at most 1 per remaining character
+            remaining--;
+            if (score > remaining && score - remaining > max)
+            {
+                return max + 1;
+            }
+        }
+    }
+
+    return score > max ? max + 1 : score;
+}
+
+utf8::fuzzy_match utf8::edit_pattern::find(std::string_view text, size_t max) const
+{
+    fuzzy_match match;
+
+    if (length_ == 0)
+    {
+        match.end = 0;
+        return match;
+    }
+
+    const char* start = text.data();
+    const char* bytes = start;
+    const char* end = bytes + text.size();
+    std::vector<uint64_t> pv(blocks_, ~0ull);
+    std::vector<uint64_t> mv(blocks_, 0);
+    const uint64_t last_bit = 1ull << ((length_ - 1) % 64);
+    size_t score = length_;
+    char32_t block[256];
+    int num_bytes;
+
+    while (bytes < end)
+    {
+        const char* pos = bytes;
+        size_t size = detail::decode_block(bytes, end, block, 256);
+        for (size_t i = 0; i < size; ++i)
+        {
+            const uint64_t* eq = masks(block[i]);
+            // an occurrence may start anywhere: the first row of the matrix stays 0
+            int carry = 0;
+            for (size_t b = 0; b < blocks_; ++b)
+            {
+                carry = advance_block(pv[b], mv[b], eq[b], carry, b + 1 < blocks_ ? LAST_BIT : last_bit);
+            }
+            score += carry;
+
+            next_sequence((const unsigned char*)pos, end - pos, num_bytes);
+            pos += num_bytes;
+
+            if (match.end != std::string_view::npos)
+            {
+                if (score >= match.distance)
+                {
+                    return match;
+                }
+                match.end = pos - start;
+                match.distance = score;
+            }
+            else if (score <= max)
+            {
+                match.end = pos - start;
+                match.distance = score;
+            }
+        }
+    }
+
+    // An empty occurrence deletes the whole pattern. After the first character the score
+    // is never greater than length_, so it is the only candidate for an empty text.
+    if (match.end == std::string_view::npos && length_ <= max)
+    {
+        match.end = 0;
+        match.distance = length_;
+    }
+
+    return match;
+}
+
+size_t utf8::edit_distance(std::string_view a, std::string_view b, size_t max, bool ignore_case)
+{
+    return edit_pattern(a, ignore_case).distance(b, max);
+}
+
+std::vector<size_t> utf8::edit_distance(std::string_view query, const std::vector<std::string_view>& candidates,
+                                        size_t max, bool ignore_case)
+{
+    edit_pattern pattern(query, ignore_case);
+    std::vector<size_t> distances;
+    distances.reserve(candidates.size());
+
+    for (std::string_view candidate : candidates)
+    {
+        distances.push_back(pattern.distance(candidate, max));
+    }
+
+    return distances;
+}
+
+utf8::fuzzy_match utf8::fuzzy_find(std::string_view text, std::string_view pattern, size_t max, bool ignore_case)
+{
+    return edit_pattern(pattern, ignore_case).find(text, max);
+}
+
+//
+// Percent-encoding, RFC 3986 section 2.1
+//
+
+// Table 3-7 checks for bytes coming one by one, as they are produced by decoding
+class sequence_state
+{
+public:
+    enum result { COMPLETE, INCOMPLETE, INVALID };
+
+    // On INVALID the byte is not consumed if a sequence was started: it must be fed again
+    result feed(unsigned char c)
+    {
+        if (length_ == 0)
+        {
+            return start(c);
+        }
+        if (c < low_ || c > high_)
+        {
+            length_ = 0;
+            return INVALID;
+        }
+        bytes_[length_++] = c;
+        low_ = 0x80;
+        high_ = 0xBF;
+        return length_ == expected_ ? COMPLETE : INCOMPLETE;
+    }
+
+    bool started() const { return length_ != 0; }
+
+    const unsigned char* bytes() const { return bytes_; }
+
+    // Length of the complete sequence, resets the state
+    int take()
+    {
+        int length = length_;
+        length_ = 0;
+        return length;
+    }
+
+    void reset()
+    {
+        length_ = 0;
+    }
+
+private:
+    result start(unsigned char c)
+    {
+        bytes_[0] = c;
+        low_ = 0x80;
+        high_ = 0xBF;
+
+        if (c < 0x80)
+        {
+            length_ = expected_ = 1;
+            return COMPLETE;
+        }
+        if (c >= 0xC2 && c <= 0xDF) // range (1)
+        {
+            expected_ = 2;
+        }
+        else if (c >= 0xE0 && c <= 0xEF)
+        {
+            expected_ = 3;
+            if (c == 0xE0) low_ = 0xA0;         // range (2)
+            else if (c == 0xED) high_ = 0x9F;   // range (3)
+        }
+        else if (c >= 0xF0 && c <= 0xF4) // range (4)
+        {
+            expected_ = 4;
+            if (c == 0xF0) low_ = 0x90;         // range (5)
+            else if (c == 0xF4) high_ = 0x8F;   // range (6)
+        }
+        else
+        {
+            return INVALID;
+        }
+        length_ = 1;
+        return INCOMPLETE;
+    }
+
+    unsigned char bytes_[4];
+    int length_ = 0;
+    int expected_ = 0;
+    unsigned char low_ = 0x80;    // range of the next byte
+    unsigned char high_ = 0xBF;
+};
+
+// True if the word has neither non-ASCII bytes nor bytes the decoder has to look at
+static inline bool is_url_clean_word(uint64_t word, bool plus_as_space)
+{
+    return !((word & HIGHS) | has_byte(word, '%') | (plus_as_space ? has_byte(word, '+') : 0));
+}
+
+// Decodes into `out`; a null replacement makes ill-formed UTF-8 an error
+template <class Writer>
+static bool percent_decode_to(const unsigned char* src, size_t len, const std::string* replacement,
+                              bool plus_as_space, Writer& out)
+{
+    const unsigned char* end = src + len;
+    const unsigned char* bytes = src;
+    const unsigned char* run = src; // clean bytes not written yet
+    sequence_state state;
+
+    while (bytes < end)
+    {
+        if (!state.started())
+        {
+            while (end - bytes >= 8 && is_url_clean_word(load_word(bytes), plus_as_space))
+            {
+                bytes += 8;
+            }
+            if (bytes == end)
+            {
+                break;
+            }
+        }
+
+        unsigned char c = *bytes;
+        int consumed = 1;
+        if (c == '%' && end - bytes >= 3 && hex_value(bytes[1]) >= 0 && hex_value(bytes[2]) >= 0)
+        {
+            c = (unsigned char)(hex_value(bytes[1]) << 4 | hex_value(bytes[2]));
+            consumed = 3;
+        }
+        else if (c == '+' && plus_as_space)
+        {
+            c = ' ';
+        }
+        else if (c < 0x80 && !state.started())
+        {
+            // ASCII outside escapes, including malformed ones, is copied as is
+            bytes++;
+            continue;
+        }
+
+        if (!state.started())
+        {
+            out.append(run, bytes - run);
+        }
+
+        bool restarted = state.started();
+        sequence_state::result result = state.feed(c);
+        if (result == sequence_state::INVALID)
+        {
+            if (replacement == nullptr)
+            {
+                return false;
+            }
+            out.append(*replacement);
+            // the byte breaking a started sequence may begin a new one
+            if (restarted)
+            {
+                run = bytes;
+                continue;
+            }
+        }
+        else if (result == sequence_state::COMPLETE)
+        {
+            out.append(state.bytes(), state.take());
+        }
+
+        bytes += consumed;
+        run = bytes;
+    }
+
+    if (state.started())
+    {
+        if (replacement == nullptr)
+        {
+            return false;
+        }
+        state.reset();
+        out.append(*replacement);
+        run = bytes;
+    }
+
+    out.append(run, bytes - run);
+    return true;
+}
+
+bool utf8::percent_decode(const char* src, size_t len, char* dst, size_t& dst_len, bool plus_as_space)
+{
+    buffer_writer out{dst};
+    bool res = percent_decode_to((const unsigned char*)src, len, nullptr, plus_as_space, out);
+    dst_len = out.pos - dst;
+    return res;
+}
+
+bool utf8::percent_decode(std::string_view src, std::string& dst, bool plus_as_space)
+{
+    dst.clear();
+    dst.reserve(src.size());
+    string_writer out{dst};
+    return percent_decode_to((const unsigned char*)src.data(), src.size(), nullptr, plus_as_space, out);
+}
+
+size_t utf8::percent_decode_fix(const char* src, size_t len, char* dst, const std::string& replacement, bool plus_as_space)
+{
+    buffer_writer out{dst};
+    percent_decode_to((const unsigned char*)src, len, &replacement, plus_as_space, out);
+    return out.pos - dst;
+}
+
+std::string utf8::percent_decode_fix(std::string_view src, const std::string& replacement, bool plus_as_space)
+{
+    std::string res;
+    res.reserve(src.size());
+    string_writer out{res};
+    percent_decode_to((const unsigned char*)src.data(), src.size(), &replacement, plus_as_space, out);
+    return res;
+}
+
+// Bitmap of ASCII characters written without encoding
+struct url_safe_set
+{
+    uint64_t bits[2] = {};
+
+    explicit url_safe_set(std::string_view safe)
+    {
+        for (unsigned char c = '0'; c <= '9'; ++c) add(c);
+        for (unsigned char c = 'A'; c <= 'Z'; ++c) add(c);
+        for (unsigned char c = 'a'; c <= 'z'; ++c) add(c);
+        for (char c : std::string_view("-._~")) add(c);
+        for (char c : safe) add(c);
+    }
+
+    void add(char c)
+    {
+        unsigned char u = (unsigned char)c;
+        if (u < 0x80) bits[u >> 6] |= 1ull << (u & 63);
+    }
+
+    bool contains(unsigned char c) const
+    {
+        return c < 0x80 && ((bits[c >> 6] >> (c & 63)) & 1);
+    }
+};
+
+template <class Writer>
+static void percent_encode_bytes(const unsigned char* bytes, size_t len, Writer& out)
+{
+    for (size_t i = 0; i < len; ++i)
+    {
+        out.put('%');
+        out.put(HEX_DIGITS[bytes[i] >> 4]);
+        out.put(HEX_DIGITS[bytes[i] & 0x0F]);
+    }
+}
+
+template <class Writer>
+static void percent_encode_to(const unsigned char* src, size_t len, const std::string& replacement,
+                              const url_safe_set& safe, Writer& out)
+{
+    const unsigned char* end = src + len;
+    const unsigned char* bytes = src;
+    const unsigned char* run = src; // bytes copied as is, not written yet
+    int num_bytes;
+
+    while (bytes < end)
+    {
+        if (safe.contains(*bytes))
+        {
+            bytes++;
+            continue;
+        }
+
+        out.append(run, bytes - run);
+        // the same repair rule as percent_decode_fix(): only the maximal ill-formed subpart is replaced
+        if (next_sequence(bytes, end - bytes, num_bytes))
+        {
+            percent_encode_bytes(bytes, num_bytes, out);
+        }
+        else
+        {
+            const unsigned char* rep = (const unsigned char*)replacement.data();
+            for (size_t i = 0; i < replacement.size(); ++i)
+            {
+                if (safe.contains(rep[i])) out.put((char)rep[i]);
+                else percent_encode_bytes(rep + i, 1, out);
+            }
+        }
+        bytes += num_bytes;
+        run = bytes;
+    }
+
+    out.append(run, bytes - run);
+}
+
+size_t utf8::percent_encode(const char* src, size_t len, char* dst, const std::string& replacement, std::string_view safe)
+{
+    buffer_writer out{dst};
+    percent_encode_to((const unsigned char*)src, len, replacement, url_safe_set(safe), out);
+    return out.pos - dst;
+}
+
+std::string utf8::percent_encode(std::string_view src, const std::string& replacement, std::string_view safe)
+{
+    std::string res;
+    res.reserve(src.size() + src.size() / 2);
+    string_writer out{res};
+    percent_encode_to((const unsigned char*)src.data(), src.size(), replacement, url_safe_set(safe), out);
+    return res;
+}
@@ -1,4 +1,14 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <initializer_list>
+#include <iterator>
 #include <string>
+#include <string_view>
+#include <tuple>
+#include <utility>
+#include <vector>
 
 namespace utf8 {
 
@@ -8,6 +18,44 @@ namespace utf8 {
 
     std::string fix_utf8(const std::string& src, const std::string& replacement);
 
+    /**
+     * @brief Classes of well-formed but unwanted code points, combined in a sanitize_policy.
+     */
+    enum sanitize_class : unsigned
+    {
+        sanitize_c0_controls = 0x01,    // U+0000..U+001F except TAB, LF, CR; U+007F
+        sanitize_c1_controls = 0x02,    // U+0080..U+009F
+        sanitize_bidi = 0x04,           // U+061C, U+200E, U+200F, U+202A..U+202E, U+2066..U+2069
+        sanitize_zero_width = 0x08,     // U+200B..U+200D, U+2060
+        sanitize_bom = 0x10,            // U+FEFF
+        sanitize_noncharacters = 0x20,  // U+FDD0..U+FDEF, U+xxFFFE, U+xxFFFF
+        sanitize_all = 0x3F
+    };
+
+    /**
+     * @brief Bitsets of sanitize_class values telling what to do with the code points.
+     * If a class is in several sets, drop wins over replace, and replace wins over escape.
+     */
+    struct sanitize_policy
+    {
+        unsigned drop = 0;      // remove the code point
+        unsigned replace = 0;   // write the replacement instead
+        unsigned escape = 0;    // write \uXXXX or \UXXXXXXXX instead
+    };
+
+    /**
+     * @brief Replaces invalid UTF-8 characters and sanitizes the text in the same pass.
+     * 
+     * @param src source bytes
+     * @param len length of the source in bytes
+     * @param dst output buffer, must hold len * max(6, replacement.length()) bytes
+     * @param replacement replacement for invalid sequences and for code points of policy.replace classes
+     * @param policy classes of code points to drop, replace or escape
+     * @return size_t number of bytes written to dst
+     */
+    size_t fix_utf8(const char* src, size_t len, char* dst, const std::string& replacement, const sanitize_policy& policy);
+    std::string fix_utf8(const std::string& src, const std::string& replacement, const sanitize_policy& policy);
+
     /**
      * @brief Calculates length of an UTF-8 string in characters.
      * 
@@ -20,4 +68,789 @@ namespace utf8 {
 
     std::string to_lower(const std::string &str);
     std::string to_upper(const std::string &str);
-}
\ No newline at end of file
+
+    /**
+     * @brief Case mapping of a single character: ASCII and Russian letters.
+     */
+    inline char32_t to_lower(char32_t code)
+    {
+        if (code >= 'A' && code <= 'Z') return code + ('a' - 'A');
+        if (code >= 0x0410 && code <= 0x042F) return code + 0x20; // [А..Я]
+        if (code == 0x0401) return 0x0451; // Ё
+        return code;
+    }
+
+    inline char32_t to_upper(char32_t code)
+    {
+        if (code >= 'a' && code <= 'z') return code - ('a' - 'A');
+        if (code >= 0x0430 && code <= 0x044F) return code - 0x20; // [а..я]
+        if (code == 0x0451) return 0x0401; // ё
+        return code;
+    }
+
+    /**
+     * @brief Escapes a string to be placed between quotes of a JSON string. Each maximal
+     * ill-formed part of invalid UTF-8 sequences is replaced in the same pass.
+     * 
+     * @param src source bytes
+     * @param len length of the source in bytes
+     * @param dst output buffer, must hold len * 6 * max(1, replacement.length()) bytes
+     * @param replacement replacement for invalid UTF-8 sequences, escaped as well
+     * @return size_t number of bytes written to dst
+     */
+    size_t json_escape(const char* src, size_t len, char* dst, const std::string& replacement);
+    std::string json_escape(const std::string& src, const std::string& replacement);
+
+    /**
+     * @brief Unescapes the content of a JSON string, checking that it is valid UTF-8
+     * in the same pass. Surrogate pairs in \uXXXX escapes are joined.
+     * 
+     * @param src source bytes, without the enclosing quotes
+     * @param len length of the source in bytes
+     * @param dst output buffer, must hold len bytes
+     * @param dst_len number of bytes written to dst
+     * @return false if the source has invalid UTF-8, a malformed escape sequence,
+     * an unpaired surrogate or an unescaped control character or quote
+     */
+    bool json_unescape(const char* src, size_t len, char* dst, size_t& dst_len);
+    bool json_unescape(const std::string& src, std::string& dst);
+
+    class codepoint_set;
+
+    /**
+     * @brief Finds the first character of the string that is a member of the set.
+     * 
+     * @param str UTF-8 string
+     * @param set characters to search for
+     * @param pos byte offset of the character to start from
+     * @return size_t byte offset of the found character, or std::string_view::npos
+     */
+    size_t find_first_of(std::string_view str, const codepoint_set& set, size_t pos = 0);
+
+    /**
+     * @brief Finds the first character of the string that is not a member of the set.
+     * An invalid sequence is never a member.
+     * 
+     * @return size_t byte offset of the found character, or std::string_view::npos
+     */
+    size_t find_first_not_of(std::string_view str, const codepoint_set& set, size_t pos = 0);
+
+    /**
+     * @brief Counts the characters of the string that are members of the set.
+     */
+    size_t count_of(std::string_view str, const codepoint_set& set);
+
+    /**
+     * @brief A set of code points compiled once for searching in UTF-8 text.
+     * ASCII members are kept in a bitmap. Multibyte members are found by their lead bytes
+     * first and then verified, so matches land on character boundaries only. Ill-formed
+     * sequences are split at their maximal subparts, the same way in all the functions.
+     */
+    class codepoint_set
+    {
+    public:
+        codepoint_set(std::initializer_list<char32_t> codes);
+
+        /**
+         * @brief Creates a set of the characters of an UTF-8 string. Invalid sequences are skipped.
+         */
+        explicit codepoint_set(std::string_view chars);
+
+        bool contains(char32_t code) const;
+
+    private:
+        void add(char32_t code);
+
+        // length of the member character at `bytes`, or 0 if there is no member
+        int match(const unsigned char* bytes, size_t avail) const;
+
+        bool is_candidate(unsigned char c) const
+        {
+            return (candidates_[c >> 6] >> (c & 63)) & 1;
+        }
+
+        static const int MAX_PROBES = 4;
+
+        uint64_t ascii_[2] = {};        // ASCII members
+        uint64_t candidates_[4] = {};   // bytes the members start with
+        unsigned char probes_[MAX_PROBES] = {}; // the candidate bytes, if there are few of them
+        int num_probes_ = 0;
+        unsigned char low_[2] = {0xFF, 0xFF};   // range of the candidate bytes: [0] ASCII, [1] lead bytes
+        unsigned char high_[2] = {0, 0};
+        std::vector<char32_t> multibyte_; // sorted members above U+007F
+
+        friend size_t find_first_of(std::string_view str, const codepoint_set& set, size_t pos);
+        friend size_t find_first_not_of(std::string_view str, const codepoint_set& set, size_t pos);
+    };
+
+    enum class encoding
+    {
+        unknown,
+        utf8,
+        utf16le,
+        utf16be,
+        cp1251,
+        koi8r,
+        latin1
+    };
+
+    struct encoding_info
+    {
+        encoding type = encoding::unknown;
+        double confidence = 0.0;    // 0..1
+        size_t bom_length = 0;      // length of the byte order mark in the buffer
+    };
+
+    /**
+     * @brief Detects the encoding of a text: UTF-8, UTF-16 with or without a BOM,
+     * CP1251, KOI8-R or Latin-1. UTF-8 validation, UTF-16 statistics and letter pair
+     * scoring for 8-bit encodings are collected in one pass. Buffers larger than 64 KiB
+     * are sampled by 16 chunks of 4 KiB; the confidence of UTF-8 is scaled down then
+     * by the share of examined bytes, as the rest may hold invalid sequences.
+     * 
+     * @param buffer text of unknown encoding
+     * @return encoding_info the most likely encoding and its confidence. Pure ASCII is reported as UTF-8,
+     * a few 8-bit characters that are not valid UTF-8 as unknown.
+     */
+    encoding_info detect_encoding(std::string_view buffer);
+
+    /**
+     * @brief Converts a text to UTF-8. A BOM is skipped, invalid sequences of UTF-8 and UTF-16 are
+     * replaced by U+FFFD. Text of the unknown encoding is handled as UTF-8.
+     */
+    std::string to_utf8(std::string_view buffer, encoding type);
+
+    /**
+     * @brief Unicode general category, see https://www.unicode.org/reports/tr44/#General_Category_Values
+     */
+    enum class general_category : unsigned char
+    {
+        Cn, // unassigned
+        Lu, Ll, Lt, Lm, Lo,
+        Mn, Mc, Me,
+        Nd, Nl, No,
+        Pc, Pd, Ps, Pe, Pi, Pf, Po,
+        Sm, Sc, Sk, So,
+        Zs, Zl, Zp,
+        Cc, Cf, Cs, Co
+    };
+
+    /**
+     * @brief Character properties from the generated Unicode tables.
+     * Values above U+10FFFF and invalid_char are unassigned.
+     */
+    general_category category(char32_t code);
+    bool is_space(char32_t code);   // White_Space
+    bool is_alpha(char32_t code);   // Alphabetic
+
+    /**
+     * @brief Removes leading and trailing white space.
+     * 
+     * @return std::string_view a view into the source
+     */
+    std::string_view trim(std::string_view str);
+
+    /**
+     * @brief Replaces every run of white space by a single U+0020.
+     * 
+     * @param str UTF-8 string
+     * @param dst output buffer, must hold str.size() bytes; may be str.data() for in-place processing
+     * @return std::string_view a view into dst
+     */
+    std::string_view collapse_whitespace(std::string_view str, char* dst);
+
+    namespace detail
+    {
+        // Splits off the next word of `rest`, returns false if there are no more words
+        bool next_word(std::string_view& rest, std::string_view& word);
+    }
+
+    /**
+     * @brief A lazy range of the words of a string separated by white space.
+     * The words are views into the string, empty words are skipped.
+     */
+    class split_range
+    {
+    public:
+        class iterator
+        {
+        public:
+            using iterator_category = std::forward_iterator_tag;
+            using value_type = std::string_view;
+            using difference_type = std::ptrdiff_t;
+            using pointer = const std::string_view*;
+            using reference = const std::string_view&;
+
+            iterator() = default;
+
+            explicit iterator(std::string_view str) : rest_(str)
+            {
+                ++*this;
+            }
+
+            reference operator*() const { return word_; }
+            pointer operator->() const { return &word_; }
+
+            iterator& operator++()
+            {
+                if (!detail::next_word(rest_, word_))
+                {
+                    word_ = std::string_view();
+                    rest_ = std::string_view();
+                }
+                return *this;
+            }
+
+            iterator operator++(int)
+            {
+                iterator prev = *this;
+                ++*this;
+                return prev;
+            }
+
+            bool operator==(const iterator& other) const
+            {
+                return word_.data() == other.word_.data() && word_.size() == other.word_.size();
+            }
+
+            bool operator!=(const iterator& other) const
+            {
+                return !(*this == other);
+            }
+
+        private:
+            std::string_view rest_;
+            std::string_view word_;
+        };
+
+        explicit split_range(std::string_view str) : str_(str) {}
+
+        iterator begin() const { return iterator(str_); }
+        iterator end() const { return iterator(); }
+
+    private:
+        std::string_view str_;
+    };
+
+    /**
+     * @brief Splits a string by runs of white space, e.g.
+     * 
+     *   for (std::string_view word : utf8::split(text)) ...
+     */
+    inline split_range split(std::string_view str)
+    {
+        return split_range(str);
+    }
+
+    enum class collation_strength
+    {
+        primary = 1,    // base letters only: "е" = "Ё" = "ё"
+        secondary = 2,  // and diacritics: "е" = "Е" < "ё" = "Ё"
+        tertiary = 3    // and case: "е" < "Е" < "ё" < "Ё"
+    };
+
+    /**
+     * @brief Makes a binary sort key of a string. Keys compared by memcmp() (or std::string
+     * comparison) give the collation order, so a sort pays the cost of collation once
+     * per element. The order follows DUCET for ASCII, Latin-1 and Russian letters with
+     * Ё sorted as a variant of Е; white space < punctuation < digits < Latin < Greek µ < Cyrillic,
+     * other characters follow by code point. Control and format characters are ignored.
+     * 
+     * @param str UTF-8 string
+     * @param strength levels of the collation to include in the key
+     * @return std::string the sort key
+     */
+    std::string sort_key(std::string_view str, collation_strength strength = collation_strength::tertiary);
+
+    /**
+     * @brief Writes a sort key to `key`, reusing its capacity.
+     */
+    void sort_key(std::string_view str, collation_strength strength, std::string& key);
+
+    /**
+     * @brief Decodes %XX escapes of an URL component and checks the decoded bytes against
+     * Table 3-7 as they are produced, so overlong forms like "%C0%AF" are rejected.
+     * Malformed escapes like "%G1" are kept as is.
+     * 
+     * @param src source bytes
+     * @param len length of the source in bytes
+     * @param dst output buffer, must hold len bytes
+     * @param dst_len number of bytes written to dst
+     * @param plus_as_space decode '+' as a space, as in query strings
+     * @return false if the decoded bytes are not valid UTF-8
+     */
+    bool percent_decode(const char* src, size_t len, char* dst, size_t& dst_len, bool plus_as_space = false);
+    bool percent_decode(std::string_view src, std::string& dst, bool plus_as_space = false);
+
+    /**
+     * @brief Decodes %XX escapes of an URL component replacing each maximal ill-formed
+     * part of the decoded bytes by `replacement`.
+     * 
+     * @param dst output buffer, must hold len * max(1, replacement.length()) bytes
+     * @return size_t number of bytes written to dst
+     */
+    size_t percent_decode_fix(const char* src, size_t len, char* dst, const std::string& replacement, bool plus_as_space = false);
+    std::string percent_decode_fix(std::string_view src, const std::string& replacement, bool plus_as_space = false);
+
+    /**
+     * @brief Percent-encodes a string for an URL component. Unreserved characters of RFC 3986
+     * (ALPHA DIGIT - . _ ~) and ASCII characters of `safe` are copied as is. Each maximal
+     * ill-formed part of invalid UTF-8 sequences is replaced in the same pass, as in
+     * percent_decode_fix(), and the replacement is encoded too.
+     * 
+     * @param dst output buffer, must hold len * 3 * max(1, replacement.length()) bytes
+     * @param safe characters not to encode, e.g. "/" for paths
+     * @return size_t number of bytes written to dst
+     */
+    size_t percent_encode(const char* src, size_t len, char* dst, const std::string& replacement, std::string_view safe = "");
+    std::string percent_encode(std::string_view src, const std::string& replacement, std::string_view safe = "");
+
+    /**
+     * @brief An approximate occurrence found by fuzzy_find().
+     */
+    struct fuzzy_match
+    {
+        size_t end = std::string_view::npos;    // byte offset past the occurrence, npos if nothing is found
+        size_t distance = 0;                    // edit distance between the pattern and the occurrence
+    };
+
+    /**
+     * @brief A pattern compiled for bit-parallel edit distance computation (Myers' algorithm
+     * in Hyyrö's formulation, by 64-character blocks). Strings are compared by characters,
+     * each ill-formed sequence counts as one character that matches nothing.
+     */
+    class edit_pattern
+    {
+    public:
+        /**
+         * @param pattern UTF-8 string
+         * @param ignore_case compare characters mapped by to_lower()
+         */
+        explicit edit_pattern(std::string_view pattern, bool ignore_case = false);
+
+        /**
+         * @brief Levenshtein distance between the pattern and a text.
+         * 
+         * @param max the limit of interest; the computation stops early once it is exceeded
+         * @return size_t the distance, or max + 1 if it is greater than max
+         */
+        size_t distance(std::string_view text, size_t max = SIZE_MAX - 1) const;
+
+        /**
+         * @brief Finds the first occurrence of the pattern in a text with at most max edits.
+         * The occurrence is extended while the distance keeps decreasing.
+         */
+        fuzzy_match find(std::string_view text, size_t max) const;
+
+        size_t length() const { return length_; }
+
+    private:
+        const uint64_t* masks(char32_t code) const;
+
+        size_t length_ = 0;     // in characters
+        size_t blocks_ = 0;     // 64-bit words per mask
+        bool ignore_case_;
+        std::vector<uint64_t> ascii_masks_;     // blocks_ words per ASCII character
+        std::vector<char32_t> codes_;           // sorted non-ASCII characters of the pattern
+        std::vector<uint64_t> code_masks_;      // blocks_ words per element of codes_, then a zero mask
+    };
+
+    /**
+     * @brief Levenshtein distance between two UTF-8 strings counted in characters.
+     * 
+     * @return size_t the distance, or max + 1 if it is greater than max
+     */
+    size_t edit_distance(std::string_view a, std::string_view b, size_t max = SIZE_MAX - 1, bool ignore_case = false);
+
+    /**
+     * @brief Distances between a query and many candidates, the query is compiled once.
+     */
+    std::vector<size_t> edit_distance(std::string_view query, const std::vector<std::string_view>& candidates,
+                                      size_t max = SIZE_MAX - 1, bool ignore_case = false);
+
+    /**
+     * @brief Finds the first occurrence of a pattern in a text with at most max edits.
+     */
+    fuzzy_match fuzzy_find(std::string_view text, std::string_view pattern, size_t max, bool ignore_case = false);
+
+    /**
+     * @brief Marks an ill-formed sequence among decoded characters.
+     */
+    const char32_t invalid_char = 0xFFFFFFFF;
+
+    namespace detail
+    {
+        // Decodes at most `max` characters of [src, end) and advances `src`.
+        // Each maximal ill-formed subpart becomes one invalid_char.
+        size_t decode_block(const char*& src, const char* end, char32_t* dst, size_t max);
+
+        // Appends UTF-8 sequences of the characters, invalid_char values are skipped.
+        void encode_block(const char32_t* src, size_t len, std::string& dst);
+
+        // Passes a character to the stage I, giving it the rest of the chain as the next one
+        template <size_t I, class Sink, class... Stages>
+        struct stage_chain
+        {
+            std::tuple<Stages...>& stages;
+            Sink& sink;
+
+            void put(char32_t code)
+            {
+                if constexpr (I == sizeof...(Stages))
+                {
+                    sink.put(code);
+                }
+                else
+                {
+                    stage_chain<I + 1, Sink, Stages...> next{stages, sink};
+                    std::get<I>(stages).put(code, next);
+                }
+            }
+
+            void finish()
+            {
+                if constexpr (I == sizeof...(Stages))
+                {
+                    sink.flush();
+                }
+                else
+                {
+                    stage_chain<I + 1, Sink, Stages...> next{stages, sink};
+                    std::get<I>(stages).finish(next);
+                }
+            }
+        };
+
+        // Collects output characters and encodes them by blocks
+        struct block_sink
+        {
+            static const size_t BLOCK_SIZE = 256;
+
+            std::string& dst;
+            char32_t block[BLOCK_SIZE];
+            size_t size = 0;
+
+            explicit block_sink(std::string& out) : dst(out) {}
+
+            void put(char32_t code)
+            {
+                block[size++] = code;
+                if (size == BLOCK_SIZE)
+                {
+                    flush();
+                }
+            }
+
+            void flush()
+            {
+                encode_block(block, size, dst);
+                size = 0;
+            }
+        };
+    }
+
+    /**
+     * Stages of a pipeline. A stage receives decoded characters one by one and passes
+     * the result to the next stage:
+     * 
+     *   template <class Next> void put(char32_t code, Next& next);
+     *   template <class Next> void finish(Next& next);    // end of the text, must call next.finish()
+     *   void reset();                                     // prepares the stage for a new text
+     *   bool done() const;                                // true if the stage passes nothing more,
+     *                                                     // the rest of the text is not decoded then
+     */
+    namespace stage
+    {
+        /**
+         * @brief Replaces each maximal ill-formed subpart by a replacement.
+         * Without this stage ill-formed sequences are dropped from the output.
+         */
+        class repair
+        {
+        public:
+            explicit repair(std::string_view replacement = "\xEF\xBF\xBD");
+
+            template <class Next>
+            void put(char32_t code, Next& next)
+            {
+                if (code != invalid_char)
+                {
+                    next.put(code);
+                    return;
+                }
+                for (char32_t c : replacement_)
+                {
+                    next.put(c);
+                }
+            }
+
+            template <class Next>
+            void finish(Next& next)
+            {
+                next.finish();
+            }
+
+            void reset() {}
+
+            bool done() const
+            {
+                return false;
+            }
+
+        private:
+            std::u32string replacement_;
+        };
+
+        /**
+         * @brief Maps characters to lower case, see to_lower().
+         */
+        struct lower
+        {
+            template <class Next>
+            void put(char32_t code, Next& next)
+            {
+                next.put(to_lower(code));
+            }
+
+            template <class Next>
+            void finish(Next& next)
+            {
+                next.finish();
+            }
+
+            void reset() {}
+
+            bool done() const
+            {
+                return false;
+            }
+        };
+
+        /**
+         * @brief Maps characters to upper case, see to_upper().
+         */
+        struct upper
+        {
+            template <class Next>
+            void put(char32_t code, Next& next)
+            {
+                next.put(to_upper(code));
+            }
+
+            template <class Next>
+            void finish(Next& next)
+            {
+                next.finish();
+            }
+
+            void reset() {}
+
+            bool done() const
+            {
+                return false;
+            }
+        };
+
+        /**
+         * @brief Replaces every run of white space by a single U+0020.
+         */
+        class collapse_whitespace
+        {
+        public:
+            template <class Next>
+            void put(char32_t code, Next& next)
+            {
+                if (!is_space(code))
+                {
+                    in_space_ = false;
+                    next.put(code);
+                }
+                else if (!in_space_)
+                {
+                    in_space_ = true;
+                    next.put(' ');
+                }
+            }
+
+            template <class Next>
+            void finish(Next& next)
+            {
+                next.finish();
+            }
+
+            void reset()
+            {
+                in_space_ = false;
+            }
+
+            bool done() const
+            {
+                return false;
+            }
+
+        private:
+            bool in_space_ = false;
+        };
+
+        /**
+         * @brief Removes leading and trailing white space.
+         */
+        class trim
+        {
+        public:
+            template <class Next>
+            void put(char32_t code, Next& next)
+            {
+                if (is_space(code))
+                {
+                    // white space is held until a character follows it
+                    if (started_)
+                    {
+                        pending_ += code;
+                    }
+                    return;
+                }
+                started_ = true;
+                for (char32_t c : pending_)
+                {
+                    next.put(c);
+                }
+                pending_.clear();
+                next.put(code);
+            }
+
+            template <class Next>
+            void finish(Next& next)
+            {
+                next.finish();
+            }
+
+            void reset()
+            {
+                started_ = false;
+                pending_.clear();
+            }
+
+            bool done() const
+            {
+                return false;
+            }
+
+        private:
+            bool started_ = false;
+            std::u32string pending_;
+        };
+
+        /**
+         * @brief Keeps at most max_length characters.
+         */
+        class truncate
+        {
+        public:
+            explicit truncate(size_t max_length) : max_length_(max_length) {}
+
+            template <class Next>
+            void put(char32_t code, Next& next)
+            {
+                if (length_ < max_length_)
+                {
+                    length_ += code != invalid_char;
+                    next.put(code);
+                }
+            }
+
+            template <class Next>
+            void finish(Next& next)
+            {
+                next.finish();
+            }
+
+            void reset()
+            {
+                length_ = 0;
+            }
+
+            bool done() const
+            {
+                return length_ >= max_length_;
+            }
+
+        private:
+            size_t max_length_;
+            size_t length_ = 0;
+        };
+    }
+
+    /**
+     * @brief A chain of stages applied to a text in one decoding loop with one output buffer.
+     * The stages are fused at compile time, e.g.:
+     * 
+     *   utf8::pipeline clean(utf8::stage::repair("?"), utf8::stage::lower(),
+     *                        utf8::stage::collapse_whitespace(), utf8::stage::trim());
+     *   std::string name = clean(input);
+     * 
+     * Stages keep state while a text is processed, so a pipeline object must not be used
+     * by several threads at once.
+     */
+    template <class... Stages>
+    class pipeline
+    {
+    public:
+        explicit pipeline(Stages... stages) : stages_(std::move(stages)...) {}
+
+        /**
+         * @brief Returns a pipeline with one more stage at the end.
+         */
+        template <class Stage>
+        pipeline<Stages..., Stage> then(Stage stage) const
+        {
+            return std::apply([&stage](const Stages&... stages) {
+                return pipeline<Stages..., Stage>(stages..., std::move(stage));
+            }, stages_);
+        }
+
+        /**
+         * @brief Processes the text, writing the result to dst. The capacity of dst is reused.
+         */
+        void operator()(std::string_view src, std::string& dst)
+        {
+            static const size_t BLOCK_SIZE = 256;
+
+            dst.clear();
+            dst.reserve(src.size());
+            std::apply([](Stages&... stages) { (stages.reset(), ...); }, stages_);
+
+            detail::block_sink sink(dst);
+            detail::stage_chain<0, detail::block_sink, Stages...> chain{stages_, sink};
+            const char* bytes = src.data();
+            const char* end = bytes + src.size();
+            char32_t block[BLOCK_SIZE];
+
+            while (bytes < end && !done())
+            {
+                size_t size = detail::decode_block(bytes, end, block, BLOCK_SIZE);
+                for (size_t i = 0; i < size; ++i)
+                {
+                    chain.put(block[i]);
+                }
+            }
+            chain.finish();
+        }
+
+        std::string operator()(std::string_view src)
+        {
+            std::string dst;
+            (*this)(src, dst);
+            return dst;
+        }
+
+    private:
+        // A stage that passes nothing more makes the rest of the text irrelevant
+        bool done() const
+        {
+            return std::apply([](const Stages&... stages) { return (stages.done() || ...); }, stages_);
+        }
+
+        std::tuple<Stages...> stages_;
+    };
+}
@@ -1,5 +1,6 @@
 #include "gtest/gtest.h"
 #include <utf8.h>
+#include <algorithm>
 
 using namespace utf8;
 
@@ -387,6 +388,58 @@ TEST(FixUTF8Test, sequence_imcomplete)
     EXPECT_EQ(fix_utf8(buf, "*"), (const char*)u8"\u002a\u002a\u005f\u002a\u002a\u002a\u002a");
 }
 
+TEST(SanitizeUTF8Test, empty_policy)
+{
+    U8BUF(u8"01Ы4_€9_\U0001f601 \u202e\u200b")
+    SET_BUF_BYTE(0, 0xC2)
+    SET_BUF_BYTE(6, 0xF0)
+    SET_BUF_BYTE(10, 0xE0)
+
+    EXPECT_EQ(fix_utf8(buf, "*", sanitize_policy()), fix_utf8(buf, "*"));
+}
+
+TEST(SanitizeUTF8Test, drop)
+{
+    sanitize_policy policy;
+    policy.drop = sanitize_all;
+
+    EXPECT_EQ(fix_utf8("a\x01\tb\x7F" "c\r\n", "*", policy), "a\tbc\r\n");
+    EXPECT_EQ(fix_utf8((const char*)u8"\ufeffuser\u202e\u2066name\u200b\u200d\u2060\u0085", "*", policy), "username");
+    EXPECT_EQ(fix_utf8((const char*)u8"x\ufdd0\ufffe\U0001FFFF\U0010FFFEy", "*", policy), "xy");
+    EXPECT_EQ(fix_utf8((const char*)u8"Ё\u2014\ufffd\U0001f601", "*", policy), (const char*)u8"Ё\u2014\ufffd\U0001f601");
+}
+
+TEST(SanitizeUTF8Test, replace_and_escape)
+{
+    sanitize_policy policy;
+    policy.replace = sanitize_bidi;
+    policy.escape = sanitize_bidi | sanitize_c0_controls | sanitize_noncharacters;
+
+    EXPECT_EQ(fix_utf8((const char*)u8"long ascii prefix\u202etxt.exe", "?", policy), "long ascii prefix?txt.exe");
+    EXPECT_EQ(fix_utf8((const char*)u8"bell\a \U0010FFFF", "?", policy), "bell\\u0007 \\U0010FFFF");
+}
+
+TEST(SanitizeUTF8Test, invalid_and_flagged)
+{
+    U8BUF(u8"0\u200b1ф")
+    SET_BUF_BYTE(5, 0xFF)
+    sanitize_policy policy;
+    policy.drop = sanitize_zero_width;
+
+    EXPECT_EQ(fix_utf8(buf, "*", policy), "01**");
+}
+
+TEST(SanitizeUTF8Test, sanitize_buffer)
+{
+    std::string src((const char*)u8"\ufeff{\"key\": \"value\"}");
+    std::string dst(src.length() * 6, '\0');
+    sanitize_policy policy;
+    policy.drop = sanitize_bom;
+
+    size_t len = fix_utf8(src.data(), src.length(), &dst[0], "*", policy);
+    EXPECT_EQ(dst.substr(0, len), "{\"key\": \"value\"}");
+}
+
 TEST(UTF8LengthTest, length_empty)
 {
     EXPECT_EQ(length(""), 0);
@@ -445,4 +498,723 @@ TEST(UTF8ToUpper, upper_ascii)
 TEST(UTF8ToUpper, upper_cyrillic)
 {
     EXPECT_EQ(to_upper("абвгдеёжзийклмнопрстуфхцчщъыьэюя"), "АБВГДЕЁЖЗИЙКЛМНОПРСТУФХЦЧЩЪЫЬЭЮЯ");
-}
\ No newline at end of file
+}
+TEST(JSONEscapeTest, empty)
+{
+    EXPECT_EQ(json_escape("", "*"), "");
+}
+
+TEST(JSONEscapeTest, escape_special)
+{
+    EXPECT_EQ(json_escape("a\"b\\c/d", "*"), "a\\\"b\\\\c/d");
+    EXPECT_EQ(json_escape("\b\f\n\r\t", "*"), "\\b\\f\\n\\r\\t");
+    EXPECT_EQ(json_escape(std::string("\x01\x1F\0z", 4), "*"), "\\u0001\\u001F\\u0000z");
+}
+
+TEST(JSONEscapeTest, escape_long_runs)
+{
+    U8BUF(u8"0123456789abcdefфЫ€\U0001f601 \"quoted\" 0123456789abcdef\n")
+
+    EXPECT_EQ(json_escape(buf, "*"), (const char*)u8"0123456789abcdefфЫ€\U0001f601 \\\"quoted\\\" 0123456789abcdef\\n");
+}
+
+TEST(JSONEscapeTest, escape_invalid)
+{
+    U8BUF(u8"01Ы4_€9_\U0001f601\"")
+    SET_BUF_BYTE(0, 0xC2)
+    SET_BUF_BYTE(6, 0xF0)
+    SET_BUF_BYTE(10, 0xE0)
+
+    // only the maximal ill-formed part is replaced, the bytes after it are kept
+    EXPECT_EQ(json_escape(buf, "*"), (const char*)u8"*1Ы4_***9*\U0001f601\\\"");
+    EXPECT_EQ(json_escape("\xF5\"}, \"admin\": true", "?"), "?\\\"}, \\\"admin\\\": true");
+    EXPECT_EQ(json_escape("a\xC3\"b", "*"), "a*\\\"b");
+
+    // the replacement is escaped too
+    EXPECT_EQ(json_escape("a\xFFz", "\"\n"), "a\\\"\\nz");
+}
+
+TEST(JSONEscapeTest, escape_buffer)
+{
+    std::string src("tab\there \xFF");
+    std::string dst(src.length() * 6, '\0');
+
+    size_t len = json_escape(src.data(), src.length(), &dst[0], "?");
+    EXPECT_EQ(dst.substr(0, len), "tab\\there ?");
+}
+
+TEST(JSONUnescapeTest, unescape)
+{
+    std::string res;
+
+    EXPECT_TRUE(json_unescape("", res));
+    EXPECT_EQ(res, "");
+    EXPECT_TRUE(json_unescape("a\\\"b\\\\c\\/d\\b\\f\\n\\r\\t", res));
+    EXPECT_EQ(res, "a\"b\\c/d\b\f\n\r\t");
+    EXPECT_TRUE(json_unescape("\\u0000", res));
+    EXPECT_EQ(res, std::string("\0", 1));
+}
+
+TEST(JSONUnescapeTest, unescape_unicode)
+{
+    std::string res;
+
+    EXPECT_TRUE(json_unescape("\\u0444\\u042B \\u20ac \\uD83D\\uDE01", res));
+    EXPECT_EQ(res, (const char*)u8"фЫ € \U0001f601");
+    EXPECT_TRUE(json_unescape((const char*)u8"фЫ long text with € sign", res));
+    EXPECT_EQ(res, (const char*)u8"фЫ long text with € sign");
+}
+
+TEST(JSONUnescapeTest, unescape_invalid)
+{
+    std::string res;
+
+    EXPECT_FALSE(json_unescape("\\x", res));
+    EXPECT_FALSE(json_unescape("abc\\", res));
+    EXPECT_FALSE(json_unescape("\\u12", res));
+    EXPECT_FALSE(json_unescape("\\u12G4", res));
+    EXPECT_FALSE(json_unescape("\\uD83D", res));
+    EXPECT_FALSE(json_unescape("\\uD83D\\u0041", res));
+    EXPECT_FALSE(json_unescape("\\uDE01", res));
+    EXPECT_FALSE(json_unescape("new\nline", res));
+    EXPECT_FALSE(json_unescape("quote\"", res));
+    EXPECT_FALSE(json_unescape("overlong \xC0\xAF", res));
+    EXPECT_FALSE(json_unescape("surrogate \xED\xA0\x80", res));
+}
+
+TEST(CodepointSetTest, contains)
+{
+    codepoint_set set{U',', U'«', U'»', U'—', U'\U0001f601'};
+    codepoint_set chars((const char*)u8",«»—\U0001f601");
+
+    for (char32_t code : {U',', U'«', U'»', U'—', U'\U0001f601'})
+    {
+        EXPECT_TRUE(set.contains(code));
+        EXPECT_TRUE(chars.contains(code));
+    }
+    EXPECT_FALSE(set.contains(U'.'));
+    EXPECT_FALSE(set.contains(U'¬'));
+    EXPECT_FALSE(set.contains(U'\U0001f602'));
+}
+
+TEST(CodepointSetTest, find_first_of)
+{
+    codepoint_set quotes{U'«', U'»'};
+    std::string_view text((const char*)u8"Он сказал: «нет» — и ушёл");
+
+    EXPECT_EQ(find_first_of(text, quotes), 19);
+    EXPECT_EQ(find_first_of(text, quotes, 21), 27);
+    EXPECT_EQ(find_first_of(text, quotes, 29), std::string_view::npos);
+    EXPECT_EQ(find_first_of("", quotes), std::string_view::npos);
+    EXPECT_EQ(find_first_of(text, codepoint_set{U':', U'—'}), 17);
+    EXPECT_EQ(find_first_of(text, codepoint_set{U'—'}), 30);
+    EXPECT_EQ(find_first_of(text, codepoint_set{U'ё'}), 41);
+}
+
+TEST(CodepointSetTest, find_first_of_boundaries)
+{
+    // U+0440 is D1 80, U+2028 is E2 80 A8: a byte search for 80 would stop inside characters
+    codepoint_set set{U' '};
+    std::string_view text((const char*)u8"рррррррррррррррр ");
+
+    EXPECT_EQ(find_first_of(text, set), 32);
+    EXPECT_EQ(find_first_of(text, codepoint_set{U' '}), std::string_view::npos);
+}
+
+TEST(CodepointSetTest, find_first_of_many_candidates)
+{
+    codepoint_set set((const char*)u8".,;:!?«»— ");
+    std::string_view text((const char*)u8"no punctuation in this long text next");
+
+    EXPECT_EQ(find_first_of(text, set), 32);
+    EXPECT_EQ(count_of(text, set), 1);
+    EXPECT_EQ(count_of((const char*)u8"a, b; «c» — d.", set), 6);
+
+    // candidates after long runs of skipped words, ASCII and multibyte
+    std::string text_ascii(1000, 'x');
+    EXPECT_EQ(find_first_of(text_ascii + "»", set), 1000);
+    EXPECT_EQ(find_first_of(text_ascii + "@[~!", set), 1003);
+    std::string cyrillic;
+    for (int i = 0; i < 100; ++i) cyrillic += (const char*)u8"текст";
+    EXPECT_EQ(find_first_of(cyrillic + (const char*)u8"—", set), 1000);
+    EXPECT_EQ(find_first_of(cyrillic, set), std::string_view::npos);
+}
+
+TEST(CodepointSetTest, ill_formed)
+{
+    // C3 followed by a lead byte is a one byte ill-formed part, the next character is «
+    codepoint_set set{U'«'};
+    std::string_view text("\xC3\xC2\xAB");
+
+    EXPECT_EQ(find_first_of(text, set), 1);
+    EXPECT_EQ(count_of(text, set), 1);
+    EXPECT_EQ(find_first_not_of(text, set), 0);
+    EXPECT_EQ(find_first_not_of(text, set, 1), std::string_view::npos);
+}
+
+TEST(CodepointSetTest, find_first_not_of)
+{
+    codepoint_set spaces{U' ', U'\t', U' ', U'　'};
+    std::string_view text((const char*)u8" \t 　word ");
+
+    EXPECT_EQ(find_first_not_of(text, spaces), 7);
+    EXPECT_EQ(find_first_not_of(text, spaces, 11), std::string_view::npos);
+    EXPECT_EQ(find_first_not_of("  \xFF", spaces), 2);
+}
+
+// "Съешь же ещё этих мягких французских булок, да выпей чаю."
+static const char CP1251_TEXT[] = "\xD1\xFA\xE5\xF8\xFC \xE6\xE5 \xE5\xF9\xB8 \xFD\xF2\xE8\xF5 \xEC\xFF\xE3\xEA\xE8\xF5 \xF4\xF0\xE0\xED\xF6\xF3\xE7\xF1\xEA\xE8\xF5 \xE1\xF3\xEB\xEE\xEA, \xE4\xE0 \xE2\xFB\xEF\xE5\xE9 \xF7\xE0\xFE.";
+static const char KOI8R_TEXT[] = "\xF3\xDF\xC5\xDB\xD8 \xD6\xC5 \xC5\xDD\xA3 \xDC\xD4\xC9\xC8 \xCD\xD1\xC7\xCB\xC9\xC8 \xC6\xD2\xC1\xCE\xC3\xD5\xDA\xD3\xCB\xC9\xC8 \xC2\xD5\xCC\xCF\xCB, \xC4\xC1 \xD7\xD9\xD0\xC5\xCA \xDE\xC1\xC0.";
+static const char RUSSIAN_TEXT[] = "Съешь же ещё этих мягких французских булок, да выпей чаю.";
+
+TEST(DetectEncodingTest, utf8)
+{
+    EXPECT_EQ(detect_encoding("").type, encoding::utf8);
+    EXPECT_EQ(detect_encoding("plain ascii").type, encoding::utf8);
+    EXPECT_EQ(detect_encoding(RUSSIAN_TEXT).type, encoding::utf8);
+    EXPECT_GT(detect_encoding(RUSSIAN_TEXT).confidence, 0.99);
+
+    encoding_info info = detect_encoding("\xEF\xBB\xBFtext");
+    EXPECT_EQ(info.type, encoding::utf8);
+    EXPECT_EQ(info.bom_length, 3);
+}
+
+TEST(DetectEncodingTest, cyrillic_codepages)
+{
+    encoding_info cp1251 = detect_encoding(CP1251_TEXT);
+    encoding_info koi8r = detect_encoding(KOI8R_TEXT);
+
+    EXPECT_EQ(cp1251.type, encoding::cp1251);
+    EXPECT_GT(cp1251.confidence, 0.5);
+    EXPECT_EQ(koi8r.type, encoding::koi8r);
+    EXPECT_GT(koi8r.confidence, 0.5);
+}
+
+TEST(DetectEncodingTest, latin1)
+{
+    // "Voilà, le garçon a mangé une crème brûlée à Zürich."
+    encoding_info info = detect_encoding("Voil\xE0, le gar\xE7on a mang\xE9 une cr\xE8me br\xFBl\xE9" "e \xE0 Z\xFCrich.");
+
+    EXPECT_EQ(info.type, encoding::latin1);
+    EXPECT_GT(info.confidence, 0.5);
+}
+
+TEST(DetectEncodingTest, short_input)
+{
+    for (const char* text : {"\xFF", "\xC0", "\xE9", "a\xE9", "\xE9 \xE0"})
+    {
+        encoding_info info = detect_encoding(text);
+        EXPECT_GE(info.confidence, 0.0) << text;
+        EXPECT_LE(info.confidence, 1.0) << text;
+    }
+
+    EXPECT_EQ(detect_encoding("\xE9").type, encoding::unknown);
+    EXPECT_EQ(detect_encoding("\xE9").confidence, 0.0);
+}
+
+TEST(DetectEncodingTest, utf16)
+{
+    // "Привет, мир"
+    std::string le("\x1F\x04@\x04" "8\x04" "2\x04" "5\x04" "B\x04,\x00 \x00<\x04" "8\x04@\x04", 22);
+    std::string be("\x00H\x00" "e\x00l\x00l\x00o", 10);
+
+    EXPECT_EQ(detect_encoding(le).type, encoding::utf16le);
+    EXPECT_EQ(detect_encoding(be).type, encoding::utf16be);
+    EXPECT_EQ(detect_encoding("\xFF\xFE" + le).bom_length, 2);
+    EXPECT_EQ(detect_encoding(std::string("\xFE\xFF", 2) + be).type, encoding::utf16be);
+}
+
+TEST(DetectEncodingTest, sampling)
+{
+    std::string text;
+    while (text.length() < 1024 * 1024)
+    {
+        text += CP1251_TEXT;
+        text += "\n";
+    }
+
+    EXPECT_EQ(detect_encoding(text).type, encoding::cp1251);
+    EXPECT_EQ(detect_encoding(to_utf8(text, encoding::cp1251)).type, encoding::utf8);
+
+    // an ASCII sample does not prove that the whole buffer is UTF-8
+    std::string ascii(120 * 1024, 'a');
+    encoding_info info = detect_encoding(ascii.substr(0, 10000) + CP1251_TEXT + ascii + ascii);
+    EXPECT_EQ(info.type, encoding::utf8);
+    EXPECT_LT(info.confidence, 0.5);
+    EXPECT_EQ(detect_encoding(std::string(64 * 1024, 'a')).confidence, 1.0);
+}
+
+TEST(ToUTF8Test, convert)
+{
+    EXPECT_EQ(to_utf8(CP1251_TEXT, encoding::cp1251), RUSSIAN_TEXT);
+    EXPECT_EQ(to_utf8(KOI8R_TEXT, encoding::koi8r), RUSSIAN_TEXT);
+    EXPECT_EQ(to_utf8("gar\xE7on", encoding::latin1), (const char*)u8"garçon");
+    EXPECT_EQ(to_utf8(std::string("\xFF\xFE\x1F\x04=\xD8\x01\xDE\x00\xD8", 10), encoding::utf16le), (const char*)u8"П\U0001f601�");
+    EXPECT_EQ(to_utf8("\xEF\xBB\xBF" "ab\xFF", encoding::utf8), (const char*)u8"ab�");
+}
+
+TEST(PipelineTest, empty)
+{
+    pipeline<> copy;
+    pipeline lower_case(stage::lower{});
+
+    EXPECT_EQ(copy(""), "");
+    EXPECT_EQ(copy((const char*)u8"ЁЖ ab"), (const char*)u8"ЁЖ ab");
+    EXPECT_EQ(lower_case(""), "");
+}
+
+TEST(PipelineTest, case_mapping)
+{
+    pipeline lower_case(stage::lower{});
+    pipeline upper_case(stage::upper{});
+
+    EXPECT_EQ(lower_case("ab cdez ABC ZX-091.FOp"), to_lower("ab cdez ABC ZX-091.FOp"));
+    EXPECT_EQ(lower_case("АБВГДЕЁЖЗИЙКЛМНОПРСТУФХЦЧЩЪЫЬЭЮЯ"), "абвгдеёжзийклмнопрстуфхцчщъыьэюя");
+    EXPECT_EQ(upper_case("абвгдеёжзийклмнопрстуфхцчщъыьэюя"), "АБВГДЕЁЖЗИЙКЛМНОПРСТУФХЦЧЩЪЫЬЭЮЯ");
+}
+
+TEST(PipelineTest, repair)
+{
+    U8BUF(u8"01Ы4_€9_\U0001f601")
+    SET_BUF_BYTE(0, 0xC2)
+    SET_BUF_BYTE(6, 0xF0)
+    SET_BUF_BYTE(10, 0xE0)
+
+    EXPECT_EQ(pipeline(stage::repair("*"))(buf), (const char*)u8"*1Ы4_***9*\U0001f601");
+    EXPECT_EQ(pipeline(stage::repair())(buf), (const char*)u8"\ufffd1Ы4_\ufffd\ufffd\ufffd9\ufffd\U0001f601");
+    EXPECT_EQ(pipeline<>()(buf), (const char*)u8"1Ы4_9\U0001f601");
+}
+
+TEST(PipelineTest, whitespace)
+{
+    pipeline collapse(stage::collapse_whitespace{});
+    pipeline trim(stage::trim{});
+
+    EXPECT_EQ(collapse((const char*)u8" a \t\n b 　c  "), " a b c ");
+    EXPECT_EQ(trim((const char*)u8"  a \t b \n"), "a \t b");
+    EXPECT_EQ(trim("   "), "");
+}
+
+TEST(PipelineTest, chain)
+{
+    auto normalize = pipeline(stage::repair("?"))
+        .then(stage::lower())
+        .then(stage::collapse_whitespace())
+        .then(stage::trim())
+        .then(stage::truncate(12));
+    std::string res;
+
+    normalize((const char*)u8"  Иван   ИВАНОВИЧ\xFF\tПетров ", res);
+    EXPECT_EQ(res, (const char*)u8"иван иванови");
+    normalize((const char*)u8"\tЁЛКА\xFF  ", res);
+    EXPECT_EQ(res, (const char*)u8"ёлка?");
+}
+
+TEST(PipelineTest, long_text)
+{
+    std::string text;
+    for (int i = 0; i < 1000; ++i)
+    {
+        text += "Слово  ";
+    }
+
+    std::string res = pipeline(stage::upper(), stage::collapse_whitespace(), stage::trim())(text);
+    EXPECT_EQ(length(res), 1000 * 6 - 1);
+    EXPECT_EQ(res.substr(0, 21), "СЛОВО СЛОВО");
+}
+
+// Counts characters passing through it
+struct counting_stage
+{
+    size_t* count;
+
+    template <class Next>
+    void put(char32_t code, Next& next)
+    {
+        ++*count;
+        next.put(code);
+    }
+
+    template <class Next>
+    void finish(Next& next)
+    {
+        next.finish();
+    }
+
+    void reset() {}
+
+    bool done() const
+    {
+        return false;
+    }
+};
+
+TEST(PipelineTest, stops_when_done)
+{
+    std::string text(1024 * 1024, 'x');
+    size_t count = 0;
+
+    std::string res = pipeline(counting_stage{&count}, stage::truncate(64))(text);
+    EXPECT_EQ(res, std::string(64, 'x'));
+    EXPECT_LE(count, 1024);
+
+    count = 0;
+    res = pipeline(counting_stage{&count}, stage::truncate(0))(text);
+    EXPECT_EQ(res, "");
+    EXPECT_EQ(count, 0);
+}
+
+static std::vector<std::string> sorted_by_keys(std::vector<std::string> strings, collation_strength strength)
+{
+    std::sort(strings.begin(), strings.end(), [strength](const std::string& a, const std::string& b) {
+        return sort_key(a, strength) < sort_key(b, strength);
+    });
+    return strings;
+}
+
+TEST(SortKeyTest, russian)
+{
+    std::vector<std::string> names = {"Яковлев", "Ёлкин", "ежов", "Елисеев", "Жуков", "Ершов", "Абрамов", "Ефимов", "Ёжиков"};
+    std::vector<std::string> expected = {"Абрамов", "Ёжиков", "ежов", "Елисеев", "Ёлкин", "Ершов", "Ефимов", "Жуков", "Яковлев"};
+
+    EXPECT_EQ(sorted_by_keys(names, collation_strength::tertiary), expected);
+}
+
+TEST(SortKeyTest, strength)
+{
+    EXPECT_EQ(sort_key("ёж", collation_strength::primary), sort_key("ЕЖ", collation_strength::primary));
+    EXPECT_LT(sort_key("еж", collation_strength::secondary), sort_key("ёж", collation_strength::secondary));
+    EXPECT_EQ(sort_key("ёж", collation_strength::secondary), sort_key("ЁЖ", collation_strength::secondary));
+    EXPECT_LT(sort_key("ёж", collation_strength::tertiary), sort_key("Ёж", collation_strength::tertiary));
+    EXPECT_LT(sort_key("Еж", collation_strength::tertiary), sort_key("ёж", collation_strength::tertiary));
+    EXPECT_EQ(sort_key("Ab", collation_strength::primary), sort_key("aB", collation_strength::primary));
+    EXPECT_EQ(sort_key("Ab", collation_strength::secondary), sort_key("aB", collation_strength::secondary));
+    EXPECT_LT(sort_key("aB"), sort_key("Ab"));
+}
+
+TEST(SortKeyTest, scripts_and_prefixes)
+{
+    std::vector<std::string> strings = {"я", "z", "a", "", "ab", "9", "10", " ", "-", "А", "b"};
+    std::vector<std::string> expected = {"", " ", "-", "10", "9", "a", "ab", "b", "z", "А", "я"};
+
+    EXPECT_EQ(sorted_by_keys(strings, collation_strength::tertiary), expected);
+}
+
+TEST(SortKeyTest, latin1)
+{
+    std::vector<std::string> strings = {"cote", "côte", "Côte", "coté", "côté", "cotz", "Cote"};
+    std::vector<std::string> expected = {"cote", "Cote", "coté", "côte", "Côte", "côté", "cotz"};
+
+    EXPECT_EQ(sorted_by_keys(strings, collation_strength::tertiary), expected);
+    EXPECT_EQ(sort_key("Straße", collation_strength::primary), sort_key("strasse", collation_strength::primary));
+
+    // letters and digits among the Latin-1 symbols
+    EXPECT_EQ(sort_key("1ª", collation_strength::secondary), sort_key("1a", collation_strength::secondary));
+    EXPECT_LT(sort_key("1a"), sort_key("1ª"));
+    EXPECT_EQ(sort_key("nº", collation_strength::primary), sort_key("no", collation_strength::primary));
+    EXPECT_EQ(sort_key("m²", collation_strength::primary), sort_key("m2", collation_strength::primary));
+    EXPECT_EQ(sort_key("½", collation_strength::primary), sort_key("1⁄2", collation_strength::primary));
+
+    std::vector<std::string> symbols = {"я", "µ", "z", "¹", "a"};
+    std::vector<std::string> symbols_expected = {"¹", "a", "z", "µ", "я"};
+    EXPECT_EQ(sorted_by_keys(symbols, collation_strength::tertiary), symbols_expected);
+}
+
+TEST(SortKeyTest, ignorable)
+{
+    EXPECT_EQ(sort_key((const char*)u8"ab\u00ad\u200bc"), sort_key("abc"));
+    EXPECT_EQ(sort_key("a\x01" "b"), sort_key("ab"));
+}
+
+TEST(PropertiesTest, is_space)
+{
+    for (char32_t code : {U'\t', U'\n', U'\v', U'\f', U'\r', U' ', U'\u0085', U'\u00a0', U'\u1680', U'\u2000',
+                          U'\u200a', U'\u2028', U'\u2029', U'\u202f', U'\u205f', U'\u3000'})
+    {
+        EXPECT_TRUE(is_space(code));
+    }
+    for (char32_t code : {U'a', U'\0', U'\u200b', U'\ufeff', U'\u180e', U'Я', char32_t(0x110000), invalid_char})
+    {
+        EXPECT_FALSE(is_space(code));
+    }
+}
+
+TEST(PropertiesTest, is_alpha)
+{
+    for (char32_t code : {U'a', U'Z', U'ё', U'Я', U'ß', U'ह', U'中', U'Ⅰ', U'\U00010348'})
+    {
+        EXPECT_TRUE(is_alpha(code));
+    }
+    for (char32_t code : {U'1', U' ', U'-', U'«', U'€', U'\U0001F601', U'￿', invalid_char})
+    {
+        EXPECT_FALSE(is_alpha(code));
+    }
+}
+
+TEST(PropertiesTest, category)
+{
+    EXPECT_EQ(category(U'A'), general_category::Lu);
+    EXPECT_EQ(category(U'я'), general_category::Ll);
+    EXPECT_EQ(category(U'7'), general_category::Nd);
+    EXPECT_EQ(category(U'—'), general_category::Pd);
+    EXPECT_EQ(category(U'«'), general_category::Pi);
+    EXPECT_EQ(category(U'€'), general_category::Sc);
+    EXPECT_EQ(category(U'\u00a0'), general_category::Zs);
+    EXPECT_EQ(category(U'\u2028'), general_category::Zl);
+    EXPECT_EQ(category(U'\u200b'), general_category::Cf);
+    EXPECT_EQ(category(U'\u0301'), general_category::Mn);
+    EXPECT_EQ(category(U'\ue000'), general_category::Co);
+    EXPECT_EQ(category(U'\U0001F601'), general_category::So);
+    EXPECT_EQ(category(char32_t(0x0378)), general_category::Cn);
+    EXPECT_EQ(category(invalid_char), general_category::Cn);
+}
+
+TEST(TrimTest, trim)
+{
+    std::string_view text((const char*)u8"\u3000 \t Иван\u00a0Петров\u2003\n");
+
+    EXPECT_EQ(trim(text), (const char*)u8"Иван\u00a0Петров");
+    EXPECT_EQ(trim(""), "");
+    EXPECT_EQ(trim(" \u00a0 "), "");
+    EXPECT_EQ(trim("abc"), "abc");
+    EXPECT_EQ(trim("  a b  "), "a b");
+    EXPECT_EQ(trim(text).data(), text.data() + 6);
+}
+
+TEST(TrimTest, trim_invalid)
+{
+    EXPECT_EQ(trim(" \xA0"), "\xA0");
+    EXPECT_EQ(trim("\xC2 "), "\xC2");
+
+    // a truncated sequence ends before the white space after it, in every function
+    std::string_view text("x\xD1\n");
+    EXPECT_EQ(trim(text), "x\xD1");
+    EXPECT_EQ(*split(text).begin(), "x\xD1");
+    std::string dst(text.size(), '\0');
+    EXPECT_EQ(collapse_whitespace(text, &dst[0]), "x\xD1 ");
+    EXPECT_EQ(pipeline(stage::repair("?"), stage::trim())(text), "x?");
+}
+
+TEST(SplitTest, split)
+{
+    std::vector<std::string_view> words;
+    for (std::string_view word : split((const char*)u8"  один,\u00a0два\t\tтри\u3000four  "))
+    {
+        words.push_back(word);
+    }
+
+    std::vector<std::string_view> expected = {(const char*)u8"один,", (const char*)u8"два", (const char*)u8"три", "four"};
+    EXPECT_EQ(words, expected);
+}
+
+TEST(SplitTest, split_empty)
+{
+    EXPECT_TRUE(split("").begin() == split("").end());
+    EXPECT_TRUE(split(" \n\u2028").begin() == split(" \n\u2028").end());
+    EXPECT_EQ(std::distance(split("a").begin(), split("a").end()), 1);
+    EXPECT_EQ(std::distance(split("a long sentence of several words").begin(), split("").end()), 6);
+}
+
+TEST(CollapseWhitespaceTest, collapse)
+{
+    std::string text((const char*)u8"\tfirst   second\u00a0\u2003third        fourth ");
+    std::string dst(text.size(), '\0');
+
+    EXPECT_EQ(collapse_whitespace(text, &dst[0]), " first second third fourth ");
+    EXPECT_EQ(collapse_whitespace("", &dst[0]), "");
+    EXPECT_EQ(collapse_whitespace(text, &text[0]), " first second third fourth ");
+
+    // in place with a multibyte space first
+    std::string wide((const char*)u8"a\u3000b");
+    EXPECT_EQ(collapse_whitespace(wide, &wide[0]), "a b");
+    std::string nbsp((const char*)u8"\u00a0x");
+    EXPECT_EQ(collapse_whitespace(nbsp, &nbsp[0]), " x");
+}
+
+TEST(EditDistanceTest, distance)
+{
+    EXPECT_EQ(edit_distance("", ""), 0);
+    EXPECT_EQ(edit_distance("abc", ""), 3);
+    EXPECT_EQ(edit_distance("", "abc"), 3);
+    EXPECT_EQ(edit_distance("kitten", "sitting"), 3);
+    EXPECT_EQ(edit_distance("flaw", "lawn"), 2);
+    EXPECT_EQ(edit_distance("Иванов", "Иваново"), 1);
+    EXPECT_EQ(edit_distance("Алёна", "Алена"), 1);
+    EXPECT_EQ(edit_distance("Пётр", "Петр"), 1);
+    EXPECT_EQ(edit_distance("\U0001f601ab", "ab\U0001f601"), 2);
+}
+
+TEST(EditDistanceTest, max_and_case)
+{
+    EXPECT_EQ(edit_distance("kitten", "sitting", 2), 3);
+    EXPECT_EQ(edit_distance("kitten", "sitting", 3), 3);
+    EXPECT_EQ(edit_distance("a", "abcdefgh", 3), 4);
+    EXPECT_EQ(edit_distance("abcdefgh", "hgfedcba", 0), 1);
+    EXPECT_EQ(edit_distance("ИВАНОВ", "иванов"), 6);
+    EXPECT_EQ(edit_distance("ИВАНОВ", "иванов", 10, true), 0);
+    EXPECT_EQ(edit_distance("Ёлкин", "елкин", 10, true), 1);
+}
+
+// Plain dynamic programming over code points
+static size_t reference_distance(const std::u32string& a, const std::u32string& b)
+{
+    std::vector<size_t> row(b.size() + 1);
+    for (size_t j = 0; j <= b.size(); ++j) row[j] = j;
+    for (size_t i = 1; i <= a.size(); ++i)
+    {
+        size_t diag = row[0];
+        row[0] = i;
+        for (size_t j = 1; j <= b.size(); ++j)
+        {
+            size_t up = row[j];
+            row[j] = std::min({row[j] + 1, row[j - 1] + 1, diag + (a[i - 1] != b[j - 1])});
+            diag = up;
+        }
+    }
+    return row[b.size()];
+}
+
+static std::string encode(const std::u32string& str)
+{
+    std::string res;
+    for (char32_t c : str)
+    {
+        if (c < 0x80)
+        {
+            res += (char)c;
+        }
+        else
+        {
+            res += (char)(0xC0 | (c >> 6));
+            res += (char)(0x80 | (c & 0x3F));
+        }
+    }
+    return res;
+}
+
+TEST(EditDistanceTest, long_strings)
+{
+    const std::u32string alphabet = U"абвгдabcd";
+    unsigned seed = 1;
+
+    for (size_t length : {63, 64, 65, 130, 200})
+    {
+        std::u32string a, b;
+        for (size_t i = 0; i < length; ++i)
+        {
+            seed = seed * 1103515245 + 12345;
+            a += alphabet[(seed >> 16) % alphabet.size()];
+            seed = seed * 1103515245 + 12345;
+            // similar strings: mostly the same characters
+            b += (seed >> 16) % 4 ? a.back() : alphabet[(seed >> 8) % alphabet.size()];
+        }
+        b.erase(length / 3, 2);
+
+        size_t expected = reference_distance(a, b);
+        EXPECT_EQ(edit_distance(encode(a), encode(b)), expected);
+        EXPECT_EQ(edit_distance(encode(b), encode(a)), expected);
+        EXPECT_EQ(edit_distance(encode(a), encode(b), expected - 1), expected);
+        EXPECT_EQ(edit_distance(encode(a), encode(b), expected / 2), expected / 2 + 1);
+    }
+}
+
+TEST(EditDistanceTest, batch)
+{
+    std::vector<std::string_view> candidates = {"Иванов", "Иваново", "ИВАНОВА", "Петров", ""};
+
+    std::vector<size_t> expected = {0, 1, 1, 3, 3};
+    EXPECT_EQ(edit_distance("иванов", candidates, 2, true), expected);
+}
+
+TEST(FuzzyFindTest, find)
+{
+    std::string_view text((const char*)u8"Список: Петров, Иванов, Сидоров");
+
+    fuzzy_match exact = fuzzy_find(text, (const char*)u8"Иванов", 0);
+    EXPECT_EQ(exact.end, 40);
+    EXPECT_EQ(exact.distance, 0);
+
+    fuzzy_match typo = fuzzy_find(text, (const char*)u8"Иваноф", 1);
+    EXPECT_EQ(typo.end, 38);
+    EXPECT_EQ(typo.distance, 1);
+
+    fuzzy_match ignore_case = fuzzy_find(text, (const char*)u8"сидоров", 0, true);
+    EXPECT_EQ(ignore_case.end, text.size());
+    EXPECT_EQ(ignore_case.distance, 0);
+
+    EXPECT_EQ(fuzzy_find(text, (const char*)u8"Кузнецов", 2).end, std::string_view::npos);
+    EXPECT_EQ(fuzzy_find(text, "", 0).end, 0);
+
+    fuzzy_match empty = fuzzy_find("", "ab", 2);
+    EXPECT_EQ(empty.end, 0);
+    EXPECT_EQ(empty.distance, 2);
+    EXPECT_EQ(fuzzy_find("", "ab", 1).end, std::string_view::npos);
+    EXPECT_EQ(fuzzy_find("xb", "ab", 2).end, 2);
+    EXPECT_EQ(fuzzy_find("xb", "ab", 2).distance, 1);
+}
+
+TEST(PercentDecodeTest, validate)
+{
+    std::string res;
+
+    EXPECT_TRUE(percent_decode("/path/%D0%BF%D1%80%D0%B8%D0%B2%D0%B5%D1%82?q=1", res));
+    EXPECT_EQ(res, (const char*)u8"/path/привет?q=1");
+
+    EXPECT_TRUE(percent_decode("a+b%20c", res));
+    EXPECT_EQ(res, "a+b c");
+    EXPECT_TRUE(percent_decode("a+b%20c", res, true));
+    EXPECT_EQ(res, "a b c");
+
+    // malformed escapes are kept
+    EXPECT_TRUE(percent_decode("100%25 %G1 %4", res));
+    EXPECT_EQ(res, "100% %G1 %4");
+
+    // raw and escaped bytes of one sequence
+    EXPECT_TRUE(percent_decode((const char*)u8"\xD0%BF%D1\x80", res));
+    EXPECT_EQ(res, (const char*)u8"пр");
+
+    EXPECT_FALSE(percent_decode("%C0%AF", res));        // overlong "/"
+    EXPECT_FALSE(percent_decode("%E0%80%AF", res));     // overlong "/"
+    EXPECT_FALSE(percent_decode("%ED%A0%80", res));     // surrogate
+    EXPECT_FALSE(percent_decode("%F4%90%80%80", res));  // above U+10FFFF
+    EXPECT_FALSE(percent_decode("%D0", res));           // truncated
+    EXPECT_FALSE(percent_decode("%D0a", res));
+}
+
+TEST(PercentDecodeTest, replace)
+{
+    EXPECT_EQ(percent_decode_fix("..%C0%AF..", "?"), "..??..");
+    EXPECT_EQ(percent_decode_fix("%E0%A0%C0x", "?"), "??x");
+    EXPECT_EQ(percent_decode_fix("%F0%9F%98%80%F0%9F%98", "?"), (const char*)u8"\U0001F600?");
+    EXPECT_EQ(percent_decode_fix("%D0%D0%BF", "?"), (const char*)u8"?п");
+    EXPECT_EQ(percent_decode_fix("%FF+%80", "", true), " ");
+
+    std::string replacement = "?";
+    EXPECT_EQ(percent_decode_fix("a%FFb", replacement), "a?b");
+    EXPECT_EQ(replacement, "?");
+
+    const char src[] = "a%ffb";
+    char dst[sizeof(src) * 3];
+    size_t len = percent_decode_fix(src, sizeof(src) - 1, dst, std::string((const char*)u8"�"));
+    EXPECT_EQ(std::string(dst, len), (const char*)u8"a�b");
+}
+
+TEST(PercentEncodeTest, encode)
+{
+    EXPECT_EQ(percent_encode("Az09-._~", "?"), "Az09-._~");
+    EXPECT_EQ(percent_encode("a b/c?d=e&f", "?"), "a%20b%2Fc%3Fd%3De%26f");
+    EXPECT_EQ(percent_encode("/a b/c", "?", "/"), "/a%20b/c");
+    EXPECT_EQ(percent_encode((const char*)u8"привет", "?"), "%D0%BF%D1%80%D0%B8%D0%B2%D0%B5%D1%82");
+    EXPECT_EQ(percent_encode("a\xC0\xAF" "b", "?"), "a%3F%3Fb");
+
+    // a truncated sequence does not swallow the ASCII after it
+    EXPECT_EQ(percent_encode("\xF5" "abc/d", "?", "/"), "%3Fabc/d");
+    EXPECT_EQ(percent_encode("a\xC3/b", "?", "/"), "a%3F/b");
+    EXPECT_EQ(percent_decode_fix("a%C3/b", "?"), "a?/b");
+    EXPECT_EQ(percent_encode("a\xFF" "b", "_"), "a_b");
+
+    std::string text = (const char*)u8"путь/к файлу?";
+    std::string decoded;
+    EXPECT_TRUE(percent_decode(percent_encode(text, "?"), decoded));
+    EXPECT_EQ(decoded, text);
+}